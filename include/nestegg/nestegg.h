@@ -113,6 +113,10 @@ extern "C" {
 #define NESTEGG_PACKET_HAS_KEYFRAME_TRUE    1 /**< Packet does not contain any keyframes */
 #define NESTEGG_PACKET_HAS_KEYFRAME_UNKNOWN 2 /**< Packet may or may not contain keyframes */
 
+#define NESTEGG_FEED_NEED_MORE_DATA 0 /**< More data must be fed before progress can be made. */
+#define NESTEGG_FEED_PACKET         1 /**< A packet was returned. */
+#define NESTEGG_FEED_HEADERS        2 /**< The stream headers have been parsed. */
+
 typedef struct nestegg nestegg;               /**< Opaque handle referencing the stream state. */
 typedef struct nestegg_packet nestegg_packet; /**< Opaque handle referencing a packet of data. */
 
@@ -150,6 +154,127 @@ typedef struct {
   void * userdata;
 } nestegg_io;
 
+/** A destination of a vectored read.  @see nestegg_init_options */
+typedef struct {
+  void * base;   /**< Start of the destination. */
+  size_t length; /**< Length of the destination in bytes. */
+} nestegg_iovec;
+
+/** A chunk of packet data.  @see nestegg_packet_chunks */
+typedef struct {
+  unsigned char * data; /**< Start of the chunk. */
+  size_t length;        /**< Length of the chunk in bytes. */
+} nestegg_packet_chunk;
+
+/** A Cluster listed in the cues.  @see nestegg_get_cue_points */
+typedef struct {
+  int64_t start_pos; /**< Starting offset of the cluster. */
+  int64_t end_pos;   /**< Offset of the last byte before the next listed
+                          cluster.  For the last one, the last byte of
+                          the last Cluster if #nestegg_build_index or
+                          #nestegg_init_with_index found the Clusters,
+                          otherwise -1. */
+  uint64_t tstamp;   /**< Starting timestamp of the cluster in
+                          nanoseconds. */
+} nestegg_cue_point;
+
+/** User supplied memory allocator.  Either all callbacks are NULL,
+    selecting malloc(3), realloc(3) and free(3), or all are set.  The
+    callbacks are never asked for zero bytes and must return memory
+    suitably aligned for any type.  Packets keep a copy of the allocator
+    and free through it in #nestegg_free_packet, so the callbacks must
+    remain usable until every packet has been freed, from whichever
+    thread frees them.  @see nestegg_init_options */
+typedef struct {
+  /** Allocate @a size bytes.  The memory need not be initialized.
+      @returns Pointer to the memory, or NULL on failure. */
+  void * (* alloc)(size_t size, void * userdata);
+
+  /** Resize the allocation at @a ptr to @a size bytes, preserving its
+      contents up to the smaller of the two sizes.  @a ptr is never NULL.
+      @returns Pointer to the memory, or NULL on failure, in which case
+               @a ptr is still valid. */
+  void * (* realloc)(void * ptr, size_t size, void * userdata);
+
+  /** Free memory returned by #alloc or #realloc.  @a ptr is never NULL. */
+  void (* free)(void * ptr, void * userdata);
+
+  /** User supplied pointer to be passed to the callbacks. */
+  void * userdata;
+} nestegg_allocator;
+
+/** Options controlling the creation of a context by
+    #nestegg_init_with_options.  Initialize with
+    #nestegg_init_options_default before changing individual fields. */
+typedef struct {
+  size_t io_buffer_size;  /**< Size in bytes of the buffer used to serve
+                               reads.  Reads of at least this size bypass
+                               the buffer.  0 selects the default. */
+  int io_buffer_adaptive; /**< Non-zero grows the buffer toward the typical
+                               Cluster size while reads are sequential and
+                               shrinks it back to #io_buffer_size after a
+                               seek. */
+  size_t skip_seek_threshold; /**< Payloads that are skipped rather than
+                                   parsed, and extend at least this many
+                                   bytes beyond the buffered data, are
+                                   skipped with a forward seek instead of
+                                   being read.  0 always reads. */
+  /** Optional vectored read callback, used in addition to the callbacks
+      in #nestegg_io to read the frame payloads of a block straight into
+      their final buffers.  Reads bytes from the current position into
+      the destinations in order, like readv(2).  Short reads are
+      permitted.  NULL reads payloads through the read callback.
+      @param iov      Destinations to read into.
+      @param count    Number of destinations.
+      @param userdata The #nestegg_io::userdata supplied by the user.
+      @returns Number of bytes read.
+      @retval  0 End of stream.
+      @retval -1 Error. */
+  int64_t (* io_readv)(nestegg_iovec const * iov, unsigned int count, void * userdata);
+  size_t packet_pool_size; /**< Bytes of packet structures and payload
+                                buffers freed by #nestegg_free_packet that
+                                are kept for reuse by later packets.  Pooled
+                                payload buffers are not zero-filled.
+                                Packets may outlive the context but must be
+                                freed on the thread using it.  0 disables
+                                recycling. */
+  nestegg_allocator allocator; /**< Allocator used for the context and
+                                    everything it allocates, including
+                                    packets. */
+  unsigned int cue_window; /**< Non-zero bounds the memory and reads of
+                               #nestegg_track_seek when the Cues follow
+                               the first Cluster: instead of loading the
+                               Cues, it bisects the Cues element on disk,
+                               reading at most this many CuePoints per
+                               step, and keeps nothing.  If that finds no
+                               entry for the track, and for other cue
+                               queries, the Cues are loaded as usual and
+                               used by later seeks.  0 loads the Cues on
+                               the first seek. */
+  size_t mmap_window_size; /**< Non-zero makes
+                                #nestegg_init_mmap_with_options map the
+                                file in windows of about this many bytes,
+                                rounded up to the page size, rather than
+                                in full, bounding the address space used.
+                                Packet data is then copied.  0 maps the
+                                whole file when the address space
+                                permits. */
+} nestegg_init_options;
+
+/** IO statistics for a context.  @see nestegg_get_io_stats */
+typedef struct {
+  uint64_t read_calls;     /**< Number of calls to the read callback. */
+  uint64_t read_bytes;     /**< Bytes returned by the read callback. */
+  uint64_t seek_calls;     /**< Number of calls to the seek callback. */
+  uint64_t buffer_seeks;   /**< Number of seeks served from the buffer. */
+  uint64_t tell_calls;     /**< Number of calls to the tell callback. */
+  uint64_t buffer_fills;   /**< Number of times the buffer was refilled. */
+  uint64_t buffer_grows;   /**< Number of times an adaptive buffer grew. */
+  uint64_t buffer_shrinks; /**< Number of times an adaptive buffer shrank. */
+  uint64_t skip_seeks;     /**< Number of skips performed by seeking. */
+  size_t buffer_size;      /**< Current size of the buffer in bytes. */
+} nestegg_io_stats;
+
 /** Parameters specific to a video track. */
 typedef struct {
   unsigned int stereo_mode;    /**< Video mode.  One of #NESTEGG_VIDEO_MONO,
@@ -228,6 +353,199 @@ typedef void (* nestegg_log)(nestegg * context, unsigned int severity, char cons
     @retval -1 Error. */
 int nestegg_init(nestegg ** context, nestegg_io io, nestegg_log callback, int64_t max_offset);
 
+/** Initialize @a options with the defaults used by #nestegg_init.
+    @param options Storage for the default options. */
+void nestegg_init_options_default(nestegg_init_options * options);
+
+/** Initialize a nestegg context as #nestegg_init, with additional options.
+    @param context  Storage for the new nestegg context.  @see nestegg_destroy
+    @param io       User supplied IO context.
+    @param callback Optional logging callback function pointer.  May be NULL.
+    @param max_offset Optional maximum offset to be read. Set -1 to ignore.
+    @param options  Options initialized by #nestegg_init_options_default.
+                    May be NULL to use the defaults.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_init_with_options(nestegg ** context, nestegg_io io, nestegg_log callback,
+                              int64_t max_offset, nestegg_init_options const * options);
+
+/** Initialize a nestegg context as #nestegg_init_with_options, using an
+    index written by #nestegg_save_index for the same stream.  Only the
+    EBML header and the elements recorded in the index are parsed, and
+    its cue and Cluster tables are used instead of the Cues.  If @a index
+    is 8 byte aligned, as a memory mapping is, the tables are used in
+    place, and it must remain valid and unmodified until the context has
+    been destroyed.
+    @param context  Storage for the new nestegg context.  @see nestegg_destroy
+    @param io       User supplied IO context.
+    @param callback Optional logging callback function pointer.  May be NULL.
+    @param options  Options initialized by #nestegg_init_options_default.
+                    May be NULL to use the defaults.
+    @param index    Index written by #nestegg_save_index.
+    @param length   The size of the index in bytes.
+    @param key      The key the index was written with.
+    @retval  0 Success.
+    @retval -1 Error, including an index that is corrupt, was written by
+               an incompatible version or host, has a different key or
+               does not match the stream. */
+int nestegg_init_with_index(nestegg ** context, nestegg_io io, nestegg_log callback,
+                            nestegg_init_options const * options, void const * index,
+                            size_t length, uint64_t key);
+
+/** Initialize a nestegg context that parses directly from memory rather
+    than through IO callbacks.  The caller retains ownership of @a buffer,
+    which must remain valid and unmodified until the context and any
+    packets read with #nestegg_read_packet_view have been destroyed.
+    @param context  Storage for the new nestegg context.  @see nestegg_destroy
+    @param buffer   Buffer containing the media stream.
+    @param length   The size of the buffer in bytes.
+    @param callback Optional logging callback function pointer.  May be NULL.
+    @param max_offset Optional maximum offset to be read. Set -1 to ignore.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_init_memory(nestegg ** context, unsigned char const * buffer, size_t length,
+                        nestegg_log callback, int64_t max_offset);
+
+/** Initialize a nestegg context that parses directly from a memory
+    mapping of the file at @a path.  The file is mapped in full when the
+    address space permits, in which case packets read with
+    #nestegg_read_packet_view point into the mapping and remain valid
+    until the context is destroyed.  Otherwise a moving window is mapped
+    and packet data is copied.  Not available on platforms without mmap.
+    @param context  Storage for the new nestegg context.  @see nestegg_destroy
+    @param path     Path of the media file to map.
+    @param callback Optional logging callback function pointer.  May be NULL.
+    @param max_offset Optional maximum offset to be read. Set -1 to ignore.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_init_mmap(nestegg ** context, char const * path, nestegg_log callback,
+                      int64_t max_offset);
+
+/** Initialize a nestegg context as #nestegg_init_mmap, with additional
+    options.
+    @param context  Storage for the new nestegg context.  @see nestegg_destroy
+    @param path     Path of the media file to map.
+    @param callback Optional logging callback function pointer.  May be NULL.
+    @param max_offset Optional maximum offset to be read. Set -1 to ignore.
+    @param options  Options initialized by #nestegg_init_options_default.
+                    May be NULL to use the defaults.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_init_mmap_with_options(nestegg ** context, char const * path,
+                                   nestegg_log callback, int64_t max_offset,
+                                   nestegg_init_options const * options);
+
+/** Open the file at @a path as a #nestegg_io that reads ahead of the
+    parser.  Reads of @a block_size bytes are kept queued ahead of the
+    read position on an io_uring, so that several are in flight at once.
+    Where io_uring is unavailable, or @a queue_depth is 0, the file is
+    read synchronously one block at a time instead.  The returned IO may
+    be passed to #nestegg_init and must be closed with
+    #nestegg_io_uring_close after the context has been destroyed.
+    @param io          Storage for the IO.
+    @param path        Path of the file to open.
+    @param block_size  Size of each read in bytes.  0 selects 256 KiB.
+    @param queue_depth Number of blocks kept queued, including the block
+                       being consumed.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_io_uring_open(nestegg_io * io, char const * path, size_t block_size,
+                          unsigned int queue_depth);
+
+/** Query whether an IO opened by #nestegg_io_uring_open reads
+    asynchronously.
+    @param io IO opened by #nestegg_io_uring_open.
+    @retval 1 Reads are queued on an io_uring.
+    @retval 0 Reads are synchronous, including after waiting on the
+              io_uring has failed. */
+int nestegg_io_uring_is_async(nestegg_io const * io);
+
+/** Close an IO opened by #nestegg_io_uring_open.
+    @param io IO opened by #nestegg_io_uring_open. */
+void nestegg_io_uring_close(nestegg_io * io);
+
+/** Range fetch callback for #nestegg_io_range_open.  Called concurrently
+    from several threads, so it must be thread-safe.
+    @param buffer   Storage for the fetched bytes.
+    @param offset   Offset of the first byte to fetch.
+    @param length   Number of bytes to fetch.
+    @param userdata The userdata supplied to #nestegg_io_range_open.
+    @returns Number of bytes fetched.  Short fetches are retried for the
+             remainder of the range.
+    @retval  0 End of the resource.
+    @retval -1 Error. */
+typedef int64_t (* nestegg_range_fetch)(void * buffer, int64_t offset, size_t length,
+                                        void * userdata);
+
+/** Open a resource served by byte range, such as an object in an HTTP
+    object store, as a #nestegg_io that fetches ahead of the parser.
+    Ranges of up to @a block_size bytes are fetched concurrently by a pool
+    of @a workers threads and handed to the parser in order, so the
+    latency of each fetch is overlapped with the others.  Where threads
+    are unavailable, or @a workers is 0, one range is fetched at a time
+    on the calling thread instead.  The returned IO may be passed to
+    #nestegg_init and must be closed with #nestegg_io_range_close after
+    the context has been destroyed.
+    @param io         Storage for the IO.
+    @param fetch      Range fetch callback.
+    @param userdata   Passed to @a fetch.
+    @param length     Length of the resource in bytes.
+    @param block_size Maximum size of each fetch in bytes.  0 selects 1 MiB.
+    @param workers    Number of fetches in flight at once.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_io_range_open(nestegg_io * io, nestegg_range_fetch fetch, void * userdata,
+                          int64_t length, size_t block_size, unsigned int workers);
+
+/** Plan the fetches of an IO opened by #nestegg_io_range_open around the
+    given boundaries, typically the Cluster offsets from
+    #nestegg_get_cue_point.  Consecutive Clusters are coalesced into one
+    fetch up to the block size, and fetches end on a boundary where one
+    is in reach, so that seeking to a Cluster starts a fresh fetch rather
+    than landing in the middle of one.  Fetches already queued are not
+    affected.
+    @param io      IO opened by #nestegg_io_range_open.
+    @param offsets Boundary offsets, in any order.  Copied.
+    @param count   Number of offsets.  0 clears the plan.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_io_range_plan(nestegg_io * io, int64_t const * offsets, unsigned int count);
+
+/** Close an IO opened by #nestegg_io_range_open.
+    @param io IO opened by #nestegg_io_range_open. */
+void nestegg_io_range_close(nestegg_io * io);
+
+/** Initialize a nestegg context for a stream that is pushed to it with
+    #nestegg_feed as the data arrives, rather than pulled through IO
+    callbacks.  The headers are parsed by #nestegg_feed once they have
+    been fed in full; until then the context has no tracks.  Seeking and
+    other operations that revisit earlier parts of the stream are not
+    supported.
+    @param context  Storage for the new nestegg context.  @see nestegg_destroy
+    @param callback Optional logging callback function pointer.  May be NULL.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_init_push(nestegg ** context, nestegg_log callback);
+
+/** Append data to a stream initialized by #nestegg_init_push and parse as
+    far as the next packet.  Each element is parsed once it has been fed
+    in full, so no data is parsed more than once regardless of how the
+    stream is split between calls.  Call again with @a length 0 after a
+    positive return to collect further packets from data already fed.
+    @param context Stream context initialized by #nestegg_init_push.
+    @param data    Data following what has been fed so far.  The data is
+                   copied and need not outlive the call.
+    @param length  Length of @a data in bytes.  May be 0.
+    @param packet  Storage for the returned nestegg_packet, or NULL if no
+                   packet was returned.  @see nestegg_free_packet
+    @retval #NESTEGG_FEED_HEADERS The headers have been parsed and the
+            track information is available.  Returned once.
+    @retval #NESTEGG_FEED_PACKET A packet was returned.
+    @retval #NESTEGG_FEED_NEED_MORE_DATA All data fed so far has been used.
+    @retval -1 Error. */
+int nestegg_feed(nestegg * context, unsigned char const * data, size_t length,
+                 nestegg_packet ** packet);
+
 /** Destroy a nestegg context and free associated memory.
     @param context #nestegg context to be freed.  @see nestegg_init */
 void nestegg_destroy(nestegg * context);
@@ -261,7 +579,10 @@ int nestegg_track_count(nestegg * context, unsigned int * tracks);
     @param max_offset  Optional maximum offset to be read. Set -1 to ignore.
     @param start_pos   Starting offset of the cluster. -1 means non-existant.
     @param end_pos     Starting offset of the cluster. -1 means non-existant or
-                       final cluster.
+                       final cluster, unless #nestegg_build_index or
+                       #nestegg_init_with_index found the Clusters, in
+                       which case the final cluster ends with the last
+                       Cluster.
     @param tstamp      Starting timestamp of the cluster.
     @retval  0 Success.
     @retval -1 Error. */
@@ -269,6 +590,67 @@ int nestegg_get_cue_point(nestegg * context, unsigned int cluster_num,
                           int64_t max_offset, int64_t * start_pos,
                           int64_t * end_pos, uint64_t * tstamp);
 
+/** Query the Clusters listed in the cues for @a track, in time order,
+    all at once.  Entries are computed in a single pass over the loaded
+    cues.
+    @param context    Stream context initialized by #nestegg_init.
+    @param track      Zero-based track number.
+    @param max_offset Optional maximum offset to be read. Set -1 to ignore.
+    @param points     Storage for up to @a count entries.  May be NULL if
+                      @a count is 0.
+    @param count      On input, the number of entries @a points can hold.
+                      On output, the number of Clusters listed for
+                      @a track, which may exceed the number stored.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_get_cue_points(nestegg * context, unsigned int track, int64_t max_offset,
+                           nestegg_cue_point * points, unsigned int * count);
+
+/** Query entry @a n of the list returned by #nestegg_get_cue_points in
+    constant time.
+    @param context    Stream context initialized by #nestegg_init.
+    @param track      Zero-based track number.
+    @param n          Zero-based entry number.
+    @param max_offset Optional maximum offset to be read. Set -1 to ignore.
+    @param point      Storage for the entry.
+    @retval  0 Success.
+    @retval -1 Error, or @a n is out of range. */
+int nestegg_get_track_cue_point(nestegg * context, unsigned int track, unsigned int n,
+                                int64_t max_offset, nestegg_cue_point * point);
+
+/** Build a seek index by scanning the Clusters, for streams without Cues.
+    Only the header of each Cluster and of the Blocks up to the first one
+    of every track are read; the rest is skipped, by seeking where
+    possible.  Each Cluster whose first Block of a track is a keyframe
+    becomes an entry for that track, which #nestegg_track_seek,
+    #nestegg_get_cue_point, #nestegg_get_cue_points and
+    #nestegg_get_track_cue_point then use in place of the Cues.  A
+    truncated stream is indexed up to the last Cluster with a Timecode.
+    The read position is left unchanged.
+    @param context Stream context initialized by #nestegg_init.
+    @retval  0 Success.
+    @retval -1 Error, or no keyframes were found. */
+int nestegg_build_index(nestegg * context);
+
+/** Write an index of @a context to @a buffer, from which
+    #nestegg_init_with_index can reopen the stream without parsing the
+    headers in full or loading the Cues.  The index records the Segment
+    offset, where the SeekHead, Info and Tracks elements and the first
+    Cluster are, the cue table and, after #nestegg_build_index, the
+    Cluster table.  The Cues are loaded first if they have not been.  The
+    index is checksummed and in host byte order.
+    @param context Stream context initialized by #nestegg_init.
+    @param key     Value identifying this version of the stream, such as
+                   one derived from its size and modification time, which
+                   must be passed to #nestegg_init_with_index.
+    @param buffer  Storage for the index.  May be NULL to query its size.
+    @param length  On input, the size of @a buffer.  On output, the size of
+                   the index.
+    @retval  0 Success.
+    @retval -1 Error, or @a buffer is too small, in which case @a length
+               is set to the size needed. */
+int nestegg_save_index(nestegg * context, uint64_t key, void * buffer, size_t * length);
+
 /** Seek to @a offset.  Stream will seek directly to offset.
     Must be used to seek to the start of a cluster; the parser will not be
     able to understand other offsets.
@@ -278,9 +660,28 @@ int nestegg_get_cue_point(nestegg * context, unsigned int cluster_num,
     @retval -1 Error. */
 int nestegg_offset_seek(nestegg * context, uint64_t offset);
 
+/** Seek to the first Cluster starting at or after @a offset, which need not
+    be the start of an element, such as an offset taken as a fraction of
+    the stream size or one following corrupt data.  Candidates are found by
+    scanning for the Cluster ID and are accepted only if they hold a
+    plausible size, a Timecode and a first Block of a known track.
+    @param context Stream context initialized by #nestegg_init.
+    @param offset  Absolute offset in bytes.
+    @param cluster Storage for the absolute offset of the Cluster found.
+    @retval  0 Success.
+    @retval -1 Error or no Cluster found. */
+int nestegg_offset_seek_resync(nestegg * context, uint64_t offset, uint64_t * cluster);
+
 /** Seek @a track to @a tstamp.  Stream seek will terminate at the earliest
     key point in the stream at or before @a tstamp.  Other tracks in the
     stream will output packets with unspecified but nearby timestamps.
+    If the stream has no usable Cues, or they list no Clusters for
+    @a track, the seek still succeeds by bisecting the Clusters of the
+    Segment instead, using the Cluster table from #nestegg_build_index
+    when there is one.  This requires a seekable stream, and may read
+    across the whole Segment: Clusters are probed throughout it, and if
+    the Cluster found holds no keyframe of @a track at or before
+    @a tstamp, earlier Clusters are read in turn until one does.
     @param context Stream context initialized by #nestegg_init.
     @param track   Zero based track number.
     @param tstamp  Absolute timestamp in nanoseconds.
@@ -288,6 +689,20 @@ int nestegg_offset_seek(nestegg * context, uint64_t offset);
     @retval -1 Error. */
 int nestegg_track_seek(nestegg * context, unsigned int track, uint64_t tstamp);
 
+/** Seek @a track to @a tstamp as #nestegg_track_seek, then read on from
+    the Cluster it found, skipping Block payloads, to the last keyframe of
+    @a track at or before @a tstamp.  The next packet read is that
+    keyframe.  For an audio track, the keyframe is the last one at or
+    before @a tstamp less the track's @c seek_preroll, so that the decoder
+    can be primed.  If there is no such keyframe in or after the Cluster,
+    the stream is left at the start of the Cluster.
+    @param context Stream context initialized by #nestegg_init.
+    @param track   Zero based track number.
+    @param tstamp  Absolute timestamp in nanoseconds.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_track_seek_precise(nestegg * context, unsigned int track, uint64_t tstamp);
+
 /** Query the type specified by @a track.
     @param context Stream context initialized by #nestegg_init.
     @param track   Zero based track number.
@@ -400,6 +815,50 @@ int nestegg_read_reset(nestegg * context);
     @retval -1 Error. */
 int nestegg_read_packet(nestegg * context, nestegg_packet ** packet);
 
+/** Read a packet of media data without copying its payload.  For contexts
+    initialized by #nestegg_init_memory, the data returned by
+    #nestegg_packet_data points directly into the source buffer and must
+    not be modified.  The same applies to contexts initialized by
+    #nestegg_init_mmap when the whole file could be mapped.  Other
+    contexts behave as #nestegg_read_packet.
+    @see nestegg_free_packet
+    @param context Stream context initialized by #nestegg_init,
+                   #nestegg_init_memory, or #nestegg_init_mmap.
+    @param packet  Storage for the returned nestegg_packet.
+    @retval  1 Additional packets may be read in subsequent calls.
+    @retval  0 End of stream.
+    @retval -1 Error. */
+int nestegg_read_packet_view(nestegg * context, nestegg_packet ** packet);
+
+/** Read a packet of media data into a caller supplied buffer.  As
+    #nestegg_read_packet, but the payloads of the packet's chunks are
+    stored one after another at the start of @a buffer, and the data
+    returned by #nestegg_packet_data points into it.  The buffer must
+    remain valid until the packet is freed.  If the payloads do not fit
+    the call fails; #nestegg_read_reset then allows the packet to be read
+    again.  #nestegg_peek_packet_size gives a sufficient capacity.
+    @see nestegg_free_packet
+    @param context  Stream context initialized by #nestegg_init.
+    @param buffer   Buffer to store the payloads in.
+    @param capacity Size of @a buffer in bytes.
+    @param packet   Storage for the returned nestegg_packet.
+    @retval  1 Additional packets may be read in subsequent calls.
+    @retval  0 End of stream.
+    @retval -1 Error. */
+int nestegg_read_packet_into(nestegg * context, unsigned char * buffer, size_t capacity,
+                             nestegg_packet ** packet);
+
+/** Query the buffer capacity needed to read the next packet with
+    #nestegg_read_packet_into without affecting the parser state.  Only
+    element headers are read.  The size is an upper bound on the
+    payload bytes of the packet.
+    @param context Stream context initialized by #nestegg_init.
+    @param size    Storage for the capacity in bytes.
+    @retval  1 Success.
+    @retval  0 End of stream.
+    @retval -1 Error. */
+int nestegg_peek_packet_size(nestegg * context, size_t * size);
+
 /** Read the last packet for a track without affecting current parser state.
     @param context  Stream context initialized by #nestegg_init.
     @param track    Zero based track number.
@@ -469,6 +928,17 @@ int nestegg_packet_count(nestegg_packet * packet, unsigned int * count);
 int nestegg_packet_data(nestegg_packet * packet, unsigned int item,
                         unsigned char ** data, size_t * length);
 
+/** Get all chunks of packet data at once.  Equivalent to calling
+    #nestegg_packet_data for each chunk counted by #nestegg_packet_count.
+    @param packet Packet initialized by #nestegg_read_packet.
+    @param chunks Storage for a pointer to the array of chunks, which
+                  remains valid until the packet is freed.
+    @param count  Storage for the number of chunks.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_packet_chunks(nestegg_packet * packet, nestegg_packet_chunk const ** chunks,
+                          unsigned int * count);
+
 /** Get a pointer to additional data with identifier @a id of additional packet
     data. If @a id isn't present in the packet, returns -1.
     @param packet  Packet initialized by #nestegg_read_packet.
@@ -545,6 +1015,14 @@ int nestegg_packet_reference_block(nestegg_packet * packet,
     @retval -1 Error. */
 int nestegg_packet_end_offset(nestegg_packet * packet, int64_t * end_offset);
 
+/** Query IO statistics accumulated since the context was created.
+    Memory-backed contexts do not use the IO callbacks or the buffer.
+    @param context Stream context initialized by #nestegg_init.
+    @param stats   Storage for the queried statistics.
+    @retval  0 Success.
+    @retval -1 Error. */
+int nestegg_get_io_stats(nestegg * context, nestegg_io_stats * stats);
+
 /** Query the presence of cues.
     @param context  Stream context initialized by #nestegg_init.
     @retval 0 The media has no cues.
@@ -4,11 +4,29 @@
  * This program is made available under an ISC-style license.  See the
  * accompanying file LICENSE for details.
  */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && !defined(_WIN32)
+#define NE_HAVE_MMAP
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#endif
+
 #include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(NE_HAVE_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "nestegg/nestegg.h"
 
 /* EBML Elements */
@@ -165,6 +183,25 @@ enum ebml_type_enum {
 #define LIMIT_BLOCK                 (1 << 30)
 #define LIMIT_FRAME                 (1 << 28)
 #define IO_BUFFER_SIZE              8192
+#define IO_BUFFER_MIN_SIZE          64
+#define IO_BUFFER_MAX_SIZE          (1 << 20)
+#define IO_BUFFER_HISTORY_RATIO     8
+#define IO_SKIP_SEEK_THRESHOLD      (1 << 16)
+#define MMAP_WINDOW_SIZE            (1 << 26)
+#define DISPATCH_ID_SLOTS           256
+#define DISPATCH_TABLE_SLOTS        64
+#define ANCESTOR_STACK_DEPTH        16
+#define POOL_CHUNK_MIN_SIZE         4096
+#define POOL_CHUNK_MAX_SIZE         (1 << 20)
+#define PACKET_POOL_MIN_PAYLOAD     256
+#define PACKET_POOL_CLASSES         17
+#define CUE_WINDOW_SCAN_SIZE        256
+#define CUE_WINDOW_BISECT_SIZE      64
+#define CLUSTER_BISECT_SIZE         4096
+#define INDEX_VERSION               1
+#define INDEX_BYTE_ORDER            0x01020304
+#define INDEX_MAX_RANGES            8
+#define INDEX_ALIGN(x)              (((x) + 7) & ~(uint64_t) 7)
 
 /* Field Flags */
 #define DESC_FLAG_NONE              0
@@ -401,21 +438,152 @@ struct segment {
 };
 
 /* Misc. */
-struct pool_node {
-  struct pool_node * next;
-  void * data;
+
+/* Parser metadata is bump allocated from zeroed chunks and freed all at
+   once.  Chunks grow geometrically from POOL_CHUNK_MIN_SIZE up to
+   POOL_CHUNK_MAX_SIZE; allocations too large to share a chunk get one of
+   their own. */
+union pool_align {
+  int64_t i;
+  double d;
+  void * p;
+};
+
+struct pool_chunk {
+  struct pool_chunk * next;
+  size_t size; /* usable bytes after the header */
+  size_t used;
 };
 
 struct pool_ctx {
-  struct pool_node * head;
+  struct pool_chunk * head;
+  size_t chunk_size; /* size of the next shared chunk */
+  nestegg_allocator const * alloc;
 };
 
 struct list_node {
   struct list_node * previous;
   struct ebml_element_desc * node;
+  unsigned int table; /* dispatch slot of node */
   unsigned char * data;
 };
 
+/* Element descriptor lookup.  Every element ID is a child of exactly one
+   descriptor table, and tables nest as a tree rooted at the top level
+   elements, so a hash of IDs to their containing table answers both
+   whether an ID is a child of the current table and whether it is a
+   child of one of its ancestors.  The latter compares the intervals the
+   tables span in a depth-first walk of the tree. */
+struct ne_dispatch_id {
+  uint64_t id; /* 0: empty */
+  struct ebml_element_desc * element;
+  unsigned int parent; /* dispatch slot of the containing table */
+};
+
+struct ne_dispatch_table {
+  struct ebml_element_desc * elements; /* NULL: empty */
+  unsigned int enter;
+  unsigned int leave;
+};
+
+struct ne_dispatch {
+  struct ne_dispatch_id ids[DISPATCH_ID_SLOTS];
+  struct ne_dispatch_table tables[DISPATCH_TABLE_SLOTS];
+  unsigned int count;
+};
+
+/* Cue points flattened into arrays once the Cues are loaded.  There is
+   one entry per CueTrackPositions, in file order.  by_track lists the
+   entries of each track sorted by time; those of track t start at
+   by_track[track_first[t]] and end before by_track[track_first[t + 1]]. */
+struct ne_cue_index {
+  unsigned int count;
+  uint64_t * tstamps;  /* CueTime in nanoseconds */
+  uint64_t * positions; /* CueClusterPosition, relative to the Segment */
+  unsigned int * tracks; /* track index */
+  unsigned int * track_first;
+  unsigned int * by_track;
+};
+
+/* A CuePoint read straight from the stream by the bounded cue loader. */
+struct ne_cue_entry {
+  int64_t end;       /* offset following the CuePoint */
+  uint64_t tstamp;   /* CueTime in nanoseconds */
+  int has_track;     /* whether position is set */
+  uint64_t position; /* CueClusterPosition of the wanted track */
+};
+
+struct ne_cue_sort {
+  uint64_t tstamp;
+  unsigned int entry;
+};
+
+/* Clusters found by nestegg_build_index, in file order. */
+struct ne_cluster_index {
+  unsigned int count;
+  uint64_t * positions; /* relative to the Segment */
+  uint64_t * sizes;     /* including the header */
+  uint64_t * tstamps;   /* Cluster Timecode in nanoseconds */
+};
+
+/* Fixed part of an index written by nestegg_save_index, followed by its
+   tables, each 8 byte aligned: the header element ranges, then the cue
+   index and the cluster index arrays.  Everything is in host byte order,
+   so the tables of an aligned index are used in place. */
+struct ne_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t checksum; /* FNV-1a of the bytes following this field */
+  uint64_t key;
+  uint64_t length;
+  int64_t segment_offset;
+  int64_t first_cluster; /* payload of the first Cluster */
+  uint64_t first_cluster_size;
+  uint32_t range_count; /* SeekHead, Info and Tracks elements */
+  uint32_t track_count;
+  uint32_t cue_count;
+  uint32_t cluster_count;
+};
+
+/* Offsets of the tables of an index. */
+struct ne_index_layout {
+  uint64_t ranges;
+  uint64_t cue_tstamps;
+  uint64_t cue_positions;
+  uint64_t cue_tracks;
+  uint64_t cue_by_track;
+  uint64_t cue_track_first;
+  uint64_t cluster_positions;
+  uint64_t cluster_sizes;
+  uint64_t cluster_tstamps;
+  uint64_t length;
+};
+
+/* Growable tables filled by nestegg_build_index before being copied into
+   the pool. */
+struct ne_scan_cluster {
+  uint64_t position;
+  uint64_t size;
+  uint64_t tstamp;
+};
+
+struct ne_scan_entry {
+  uint64_t tstamp;
+  uint64_t position;
+  unsigned int track;
+};
+
+struct ne_index_scan {
+  struct ne_scan_cluster * clusters;
+  unsigned int cluster_count;
+  unsigned int cluster_capacity;
+  struct ne_scan_entry * entries;
+  unsigned int entry_count;
+  unsigned int entry_capacity;
+  unsigned char * seen; /* per track, whether the current Cluster has a Block */
+};
+
 struct saved_state {
   int64_t stream_offset;
   uint64_t last_id;
@@ -424,18 +592,37 @@ struct saved_state {
 };
 
 struct frame_encryption {
-  unsigned char * iv;
+  unsigned char iv[IV_SIZE];
   size_t length;
   uint8_t signal_byte;
   uint8_t num_partitions;
   uint32_t * partition_offsets;
+  struct frame_encryption * next; /* free list link while pooled */
 };
 
-struct frame {
-  unsigned char * data;
-  size_t length;
-  struct frame_encryption * frame_encryption;
-  struct frame * next;
+/* Packet storage recycled by a context created with a packet pool.
+   Payload buffers are rounded up to a power of two size class and carry
+   a header recording it; buffers beyond the largest class are allocated
+   exactly and never kept.  Nothing handed out is zero-filled.  Packets
+   hold a reference so that they may outlive the context; once the
+   context is destroyed the pool stops caching and is freed with the last
+   packet. */
+union ne_payload_header {
+  union pool_align align;
+  struct {
+    union ne_payload_header * next; /* free list link while pooled */
+    unsigned int size_class;        /* PACKET_POOL_CLASSES: unpooled */
+  } h;
+};
+
+struct ne_packet_pool {
+  nestegg_allocator alloc;
+  unsigned int refs; /* the context and each outstanding packet */
+  size_t limit;      /* bytes of storage kept for reuse */
+  size_t cached;
+  nestegg_packet * packets;
+  struct frame_encryption * encryptions;
+  union ne_payload_header * payloads[PACKET_POOL_CLASSES];
 };
 
 struct block_additional {
@@ -445,25 +632,88 @@ struct block_additional {
   struct block_additional * next;
 };
 
+/* Where ne_read_block places frame payloads. */
+struct ne_packet_dest {
+  int view;            /* borrow payloads from a whole memory-backed stream */
+  unsigned char * buf; /* NULL: allocate each payload */
+  size_t capacity;
+};
+
+/* File mapping backing a memory-backed stream opened by path. */
+struct ne_mapping {
+  int fd;
+  size_t granularity; /* alignment of window offsets */
+  size_t window;      /* maximum size of a window */
+};
+
+/* Storage and scan state of a memory-backed stream fed by nestegg_feed. */
+struct ne_push {
+  unsigned char * buf;
+  size_t capacity;
+  int headers;      /* non-zero once the headers have been parsed */
+  int64_t scan_pos; /* next element header to be checked for completeness */
+  int64_t need;     /* stream size required before scanning again */
+};
+
 /* Internal I/O wrapper. */
 typedef struct {
   nestegg_io * io;
-  unsigned char buf[IO_BUFFER_SIZE];
+  unsigned char * buf;
+  size_t buf_size;
   size_t buf_offset;
   size_t buf_fill;
+  /* Adaptive buffer sizing.  The buffer grows from buf_base_size toward
+     buf_target_size while refills are sequential and drops back to
+     buf_base_size after a non-sequential refill. */
+  int adaptive;
+  size_t buf_base_size;
+  size_t buf_target_size;
+  int64_t fill_start; /* stream range of the last refill; -1 if none */
+  int64_t fill_end;
+  /* Position of the callback stream, just past the buffered bytes.
+     Tracked across reads and seeks so the tell callback is only needed
+     to establish it initially; -1 if unknown. */
+  int64_t pos;
+  nestegg_io_stats stats;
+  size_t skip_threshold; /* 0: never skip by seeking */
+  int64_t (* readv)(nestegg_iovec const *, unsigned int, void *); /* optional */
   int64_t max_offset; /* <= 0: no limit */
   int poisoned; /* logical position is unknown until a successful seek */
+  /* Memory-backed stream.  When mem is non-NULL all reads, seeks, and
+     tells are served from memory and the callbacks are unused.  mem is a
+     window of mem_length bytes starting at stream offset mem_base; if
+     mapping is non-NULL the window is moved on demand, if push is
+     non-NULL it holds the unconsumed tail of the data fed so far,
+     otherwise it covers the whole stream. */
+  unsigned char const * mem;
+  size_t mem_length;
+  int64_t mem_base;
+  int64_t mem_pos;
+  int64_t mem_size;
+  struct ne_mapping * mapping;
+  struct ne_push * push;
+  nestegg_allocator const * alloc; /* the context's allocator */
 } ne_io;
 
 /* Public (opaque) Structures */
 struct nestegg {
   ne_io io;
   nestegg_log log;
+  nestegg_allocator alloc;
   struct pool_ctx * alloc_pool;
+  struct ne_dispatch dispatch;
+  struct list_node ancestor_stack[ANCESTOR_STACK_DEPTH];
+  unsigned int ancestor_depth;
   uint64_t last_id;
   uint64_t last_size;
   int last_valid;
   struct list_node * ancestor;
+  struct ne_packet_pool * packet_pool; /* NULL: packets are not recycled */
+  struct ne_cue_index * cue_index; /* NULL until the Cues are loaded */
+  struct ne_cluster_index * cluster_index; /* NULL until nestegg_build_index */
+  unsigned int cue_window; /* 0: load all Cues on the first seek */
+  int64_t cues_start; /* payload of the Cues element, 0 until located */
+  int64_t cues_end;
   struct ebml ebml;
   struct segment segment;
   int64_t segment_offset;
@@ -472,21 +722,34 @@ struct nestegg {
   uint64_t cluster_timecode;
   int read_cluster_timecode;
   struct saved_state saved;
+  struct saved_state first_cluster; /* parser state at the first Cluster */
 };
 
+/* The fields read for every packet come first; those set by some blocks
+   only follow.  Frames are an array, held inline for unlaced blocks, and
+   the payloads of all frames share one buffer. */
 struct nestegg_packet {
   uint64_t track;
   uint64_t timecode;
+  uint8_t keyframe;
+  unsigned int frame_count;
+  nestegg_packet_chunk * frames;
+  nestegg_packet_chunk frame_storage[1];
+  int64_t end_offset;
+
   uint64_t duration;
   int read_duration;
-  struct frame * frame;
-  struct block_additional * block_additional;
   int64_t discard_padding;
   int read_discard_padding;
   int64_t reference_block;
   int read_reference_block;
-  uint8_t keyframe;
-  int64_t end_offset;
+  struct frame_encryption * encryption; /* never laced */
+  struct block_additional * block_additional;
+
+  unsigned char * payload; /* NULL: payloads are borrowed */
+  struct ne_packet_pool * pool;
+  nestegg_allocator alloc; /* copied so the packet may outlive the context */
+  nestegg_packet * next; /* free list link while pooled */
 };
 
 /* Element Descriptor */
@@ -690,50 +953,266 @@ static struct ebml_element_desc ne_top_level_elements[] = {
 #undef E_SUSPEND
 #undef E_LAST
 
+static void *
+ne_default_alloc(size_t size, void * userdata)
+{
+  return malloc(size);
+}
+
+static void *
+ne_default_realloc(void * ptr, size_t size, void * userdata)
+{
+  return realloc(ptr, size);
+}
+
+static void
+ne_default_free(void * ptr, void * userdata)
+{
+  free(ptr);
+}
+
+/* Allocate size uninitialized bytes.  Callbacks never see a zero size. */
+static void *
+ne_malloc(nestegg_allocator const * a, size_t size)
+{
+  return a->alloc(size ? size : 1, a->userdata);
+}
+
+static void *
+ne_realloc(nestegg_allocator const * a, void * ptr, size_t size)
+{
+  return a->realloc(ptr, size ? size : 1, a->userdata);
+}
+
+static void
+ne_free(nestegg_allocator const * a, void * ptr)
+{
+  if (ptr)
+    a->free(ptr, a->userdata);
+}
+
+/* Allocate size zeroed bytes. */
+static void *
+ne_alloc(nestegg_allocator const * a, size_t size)
+{
+  void * p = ne_malloc(a, size);
+
+  if (p)
+    memset(p, 0, size);
+  return p;
+}
+
 static struct pool_ctx *
-ne_pool_init(void)
+ne_pool_init(nestegg_allocator const * a)
 {
-  return calloc(1, sizeof(struct pool_ctx));
+  struct pool_ctx * pool = ne_alloc(a, sizeof(struct pool_ctx));
+  if (pool) {
+    pool->chunk_size = POOL_CHUNK_MIN_SIZE;
+    pool->alloc = a;
+  }
+  return pool;
 }
 
 static void
 ne_pool_destroy(struct pool_ctx * pool)
 {
-  struct pool_node * node = pool->head;
-  while (node) {
-    struct pool_node * old = node;
-    node = node->next;
-    free(old->data);
-    free(old);
+  struct pool_chunk * chunk = pool->head;
+  while (chunk) {
+    struct pool_chunk * old = chunk;
+    chunk = chunk->next;
+    ne_free(pool->alloc, old);
   }
-  free(pool);
+  ne_free(pool->alloc, pool);
 }
 
+/* Offset of the data in a chunk, rounded up so it is suitably aligned. */
+#define POOL_CHUNK_HEADER \
+  ((sizeof(struct pool_chunk) + sizeof(union pool_align) - 1) / \
+   sizeof(union pool_align) * sizeof(union pool_align))
+
 static void *
 ne_pool_alloc(size_t size, struct pool_ctx * pool)
 {
-  struct pool_node * node;
+  struct pool_chunk * chunk = pool->head;
+  int dedicated;
 
-  node = calloc(1, sizeof(*node));
-  if (!node)
+  if (size > (size_t) -1 - POOL_CHUNK_HEADER - sizeof(union pool_align))
     return NULL;
+  size = (size + sizeof(union pool_align) - 1) / sizeof(union pool_align) *
+         sizeof(union pool_align);
 
-  node->data = calloc(1, size);
-  if (!node->data) {
-    free(node);
-    return NULL;
+  if (!chunk || chunk->size - chunk->used < size) {
+    dedicated = size > pool->chunk_size / 4;
+    chunk = ne_alloc(pool->alloc, POOL_CHUNK_HEADER + (dedicated ? size : pool->chunk_size));
+    if (!chunk)
+      return NULL;
+    chunk->size = dedicated ? size : pool->chunk_size;
+    if (dedicated && pool->head) {
+      /* Keep allocating from the current shared chunk. */
+      chunk->next = pool->head->next;
+      pool->head->next = chunk;
+    } else {
+      chunk->next = pool->head;
+      pool->head = chunk;
+      if (!dedicated && pool->chunk_size < POOL_CHUNK_MAX_SIZE)
+        pool->chunk_size *= 2;
+    }
   }
 
-  node->next = pool->head;
-  pool->head = node;
+  chunk->used += size;
+  return (unsigned char *) chunk + POOL_CHUNK_HEADER + chunk->used - size;
+}
+
+/* Number of bytes a memory-backed stream can serve before reaching the
+   end of the stream or max_offset. */
+static uint64_t
+ne_io_mem_available(ne_io * io)
+{
+  int64_t end = io->mem_size;
 
-  return node->data;
+  if (io->max_offset > 0 && io->max_offset < end)
+    end = io->max_offset;
+  if (io->mem_pos >= end)
+    return 0;
+  return (uint64_t) (end - io->mem_pos);
 }
 
-static void *
-ne_alloc(size_t size)
+/* Returns non-zero if the memory window spans the whole stream, meaning
+   pointers into it stay valid for the lifetime of the stream. */
+static int
+ne_io_mem_is_whole(ne_io * io)
+{
+  return io->mem && !io->push && io->mem_base == 0 &&
+         (uint64_t) io->mem_length == (uint64_t) io->mem_size;
+}
+
+/* Map a new window of a file-backed stream so that it contains pos. */
+static int
+ne_io_mem_remap(ne_io * io, int64_t pos)
+{
+#if defined(NE_HAVE_MMAP)
+  struct ne_mapping * m = io->mapping;
+  int64_t base;
+  uint64_t length;
+  void * addr;
+
+  if (!m || pos < 0 || pos >= io->mem_size)
+    return -1;
+
+  base = pos - pos % (int64_t) m->granularity;
+  length = (uint64_t) (io->mem_size - base);
+  if (length > m->window)
+    length = m->window;
+
+  addr = mmap(NULL, (size_t) length, PROT_READ, MAP_PRIVATE, m->fd, (off_t) base);
+  if (addr == MAP_FAILED)
+    return -1;
+
+  if (io->mem)
+    munmap((void *) io->mem, io->mem_length);
+  io->mem = addr;
+  io->mem_base = base;
+  io->mem_length = (size_t) length;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+static void
+ne_io_mem_close(ne_io * io)
+{
+  if (io->push) {
+    ne_free(io->alloc, io->push->buf);
+    ne_free(io->alloc, io->push);
+    io->push = NULL;
+    io->mem = NULL;
+  }
+#if defined(NE_HAVE_MMAP)
+  if (!io->mapping)
+    return;
+  if (io->mem)
+    munmap((void *) io->mem, io->mem_length);
+  close(io->mapping->fd);
+  ne_free(io->alloc, io->mapping);
+  io->mapping = NULL;
+  io->mem = NULL;
+#endif
+}
+
+/* Append length bytes to a pushed stream.  Bytes before keep will not be
+   read again and are dropped when the buffer needs room. */
+static int
+ne_io_push_append(ne_io * io, int64_t keep, unsigned char const * data, size_t length)
+{
+  struct ne_push * p = io->push;
+  size_t drop;
+  size_t used;
+
+  assert(keep >= io->mem_base && keep <= io->mem_size);
+  if (length > p->capacity - io->mem_length) {
+    drop = (size_t) (keep - io->mem_base);
+    used = io->mem_length - drop;
+    if (length > (size_t) -1 - used)
+      return -1;
+    if (used + length > p->capacity) {
+      size_t capacity = p->capacity;
+      unsigned char * buf;
+
+      while (capacity < used + length)
+        capacity = capacity > (size_t) -1 / 2 ? used + length : capacity * 2;
+      buf = ne_realloc(io->alloc, p->buf, capacity);
+      if (!buf)
+        return -1;
+      memmove(buf, buf + drop, used);
+      p->buf = buf;
+      p->capacity = capacity;
+    } else {
+      memmove(p->buf, p->buf + drop, used);
+    }
+    io->mem_base += drop;
+    io->mem_length = used;
+  }
+
+  memcpy(p->buf + io->mem_length, data, length);
+  io->mem = p->buf;
+  io->mem_length += length;
+  io->mem_size += length;
+  return 0;
+}
+
+/* Copy length bytes out of a memory-backed stream, moving the window as
+   required.  Like ne_io_read, this either reads everything or nothing. */
+static int
+ne_io_mem_read(ne_io * io, unsigned char * out, size_t length)
 {
-  return calloc(1, size);
+  int64_t start = io->mem_pos;
+
+  if (io->poisoned)
+    return -1;
+  if ((uint64_t) length > ne_io_mem_available(io))
+    return 0;
+
+  while (length > 0) {
+    size_t n;
+
+    if (io->mem_pos < io->mem_base ||
+        io->mem_pos - io->mem_base >= (int64_t) io->mem_length) {
+      if (ne_io_mem_remap(io, io->mem_pos) != 0) {
+        io->mem_pos = start;
+        return -1;
+      }
+    }
+    n = io->mem_length - (size_t) (io->mem_pos - io->mem_base);
+    if (n > length)
+      n = length;
+    memcpy(out, io->mem + (io->mem_pos - io->mem_base), n);
+    out += n;
+    length -= n;
+    io->mem_pos += n;
+  }
+
+  return 1;
 }
 
 static int
@@ -741,10 +1220,27 @@ ne_io_seek(ne_io * io, int64_t offset, int whence)
 {
   int r;
   assert(whence == NESTEGG_SEEK_SET);
+  if (io->mem) {
+    io->poisoned = offset < 0 || offset > io->mem_size;
+    if (io->poisoned)
+      return -1;
+    io->mem_pos = offset;
+    return 0;
+  }
+  /* The buffer holds the buf_fill bytes before the stream position, so
+     targets within it only need the buffer offset moved. */
+  if (!io->poisoned && io->pos >= 0 && offset <= io->pos &&
+      io->pos - offset <= (int64_t) io->buf_fill) {
+    io->buf_offset = io->buf_fill - (size_t) (io->pos - offset);
+    io->stats.buffer_seeks += 1;
+    return 0;
+  }
   r = io->io->seek(offset, whence, io->io->userdata);
+  io->stats.seek_calls += 1;
   io->buf_offset = 0;
   io->buf_fill = 0;
   io->poisoned = r != 0;
+  io->pos = r == 0 ? offset : -1;
   return r;
 }
 
@@ -755,9 +1251,16 @@ ne_io_tell(ne_io * io)
 
   if (io->poisoned)
     return -1;
-  pos = io->io->tell(io->io->userdata);
-  if (pos < 0)
-    return -1;
+  if (io->mem)
+    return io->mem_pos;
+  pos = io->pos;
+  if (pos < 0) {
+    pos = io->io->tell(io->io->userdata);
+    io->stats.tell_calls += 1;
+    if (pos < 0)
+      return -1;
+    io->pos = pos;
+  }
   assert(io->buf_fill >= io->buf_offset);
   return pos - (int64_t) (io->buf_fill - io->buf_offset);
 }
@@ -782,15 +1285,9 @@ ne_io_read_from_buffer(ne_io * io, unsigned char * out, size_t length)
   return 1;
 }
 
-static int
-ne_io_rewind_to_logical_pos(ne_io * io)
-{
-  int64_t pos = ne_io_tell(io);
-  if (pos < 0)
-    return -1;
-  return ne_io_seek(io, pos, NESTEGG_SEEK_SET);
-}
-
+/* Read length bytes from the callbacks, bypassing the buffer, which must
+   be empty.  On failure the stream is returned to where the read
+   started. */
 static int
 ne_io_read_direct(ne_io * io, unsigned char * out, size_t length)
 {
@@ -798,6 +1295,7 @@ ne_io_read_direct(ne_io * io, unsigned char * out, size_t length)
   int64_t pos;
   int64_t r;
 
+  assert(io->buf_fill == 0);
   if (saved_pos < 0)
     return -1;
   pos = saved_pos;
@@ -813,40 +1311,110 @@ ne_io_read_direct(ne_io * io, unsigned char * out, size_t length)
       request = ne_io_clamp_request(request, remaining);
     }
     r = io->io->read(out, request, io->io->userdata);
-    if (r <= 0) {
+    io->stats.read_calls += 1;
+    if (r <= 0 || (size_t) r > request) {
+      /* Only a clean end of stream leaves the position known. */
+      if (r != 0)
+        io->pos = -1;
       if (ne_io_seek(io, saved_pos, NESTEGG_SEEK_SET) != 0)
         return -1;
       return r == 0 ? 0 : -1;
     }
-    if ((size_t) r > request) {
-      ne_io_seek(io, saved_pos, NESTEGG_SEEK_SET);
-      return -1;
-    }
+    io->stats.read_bytes += r;
     out += r;
     length -= r;
     pos += r;
+    io->pos = pos;
   }
 
   return 1;
 }
 
+/* Resize the buffer before a refill starting at pos.  Refills that start
+   within the range covered by the previous refill are sequential and
+   grow the buffer; anything else is treated as a seek and shrinks it
+   back to the base size.  The buffered bytes are preserved and resizing
+   is best effort. */
+static void
+ne_io_adapt_buffer(ne_io * io, int64_t pos, size_t length)
+{
+  size_t size = io->buf_size;
+  unsigned char * buf;
+
+  if (io->fill_start >= 0 && pos >= io->fill_start && pos <= io->fill_end) {
+    if (size < io->buf_target_size) {
+      size = size > io->buf_target_size / 2 ? io->buf_target_size : size * 2;
+    }
+  } else {
+    size = io->buf_base_size;
+  }
+
+  /* The pending read must still fit in the buffer. */
+  if (size == io->buf_size || size <= io->buf_offset + length)
+    return;
+
+  buf = ne_realloc(io->alloc, io->buf, size);
+  if (!buf)
+    return;
+  io->buf = buf;
+  if (size > io->buf_size)
+    io->stats.buffer_grows += 1;
+  else
+    io->stats.buffer_shrinks += 1;
+  io->buf_size = size;
+}
+
+/* Hint the typical distance between seeks, such as the size of a
+   Cluster, so an adaptive buffer can grow toward it. */
+static void
+ne_io_size_hint(ne_io * io, uint64_t size)
+{
+  if (!io->adaptive)
+    return;
+  if (size < io->buf_base_size)
+    size = io->buf_base_size;
+  if (size > IO_BUFFER_MAX_SIZE)
+    size = IO_BUFFER_MAX_SIZE;
+  io->buf_target_size = (io->buf_target_size * 3 + (size_t) size) / 4;
+}
+
+/* Refill the buffer until at least length bytes are available after
+   buf_offset.  The unconsumed bytes, and a short history before them so
+   that small backward seeks can be served from the buffer, are moved to
+   the front and new data is appended after them.  The buffer always ends
+   at the callback stream position, so a short refill leaves the logical
+   position unchanged without seeking back. */
 static int
 ne_io_fill_buffer(ne_io * io, size_t length)
 {
   int64_t saved_pos;
   int64_t pos;
   int64_t r;
+  size_t buffered;
+  size_t keep;
   int io_error = 0;
 
-  io->buf_offset = 0;
-  io->buf_fill = 0;
-
+  assert(length < io->buf_size);
   saved_pos = ne_io_tell(io);
   if (saved_pos < 0)
     return -1;
-  pos = saved_pos;
-  while (io->buf_fill < length) {
-    size_t request = IO_BUFFER_SIZE - io->buf_fill;
+
+  buffered = io->buf_fill - io->buf_offset;
+  keep = io->buf_size / IO_BUFFER_HISTORY_RATIO;
+  if (keep > io->buf_offset)
+    keep = io->buf_offset;
+  if (keep > io->buf_size - length)
+    keep = io->buf_size - length;
+  memmove(io->buf, io->buf + io->buf_offset - keep, keep + buffered);
+  io->buf_offset = keep;
+  io->buf_fill = keep + buffered;
+
+  if (io->adaptive)
+    ne_io_adapt_buffer(io, saved_pos, length);
+  io->stats.buffer_fills += 1;
+  pos = saved_pos + (int64_t) buffered;
+  while (io->buf_fill - io->buf_offset < length) {
+    size_t request = io->buf_size - io->buf_fill;
     if (io->max_offset > 0) {
       int64_t remaining = io->max_offset - pos;
       if (remaining <= 0)
@@ -854,27 +1422,32 @@ ne_io_fill_buffer(ne_io * io, size_t length)
       request = ne_io_clamp_request(request, remaining);
     }
     r = io->io->read(io->buf + io->buf_fill, request, io->io->userdata);
+    io->stats.read_calls += 1;
     if (r <= 0) {
-      if (io->buf_fill == 0)
-        return r == 0 ? 0 : -1;
-      if (r < 0)
+      /* The stream position is unknown after a failed read. */
+      if (r < 0) {
+        io->pos = -1;
         io_error = 1;
+      }
       break;
     }
     if ((size_t) r > request) {
+      io->pos = -1;
       ne_io_seek(io, saved_pos, NESTEGG_SEEK_SET);
       return -1;
     }
+    io->stats.read_bytes += r;
     io->buf_fill += r;
-    assert(io->buf_fill <= IO_BUFFER_SIZE);
+    assert(io->buf_fill <= io->buf_size);
     pos += r;
+    io->pos = pos;
   }
 
-  if (length > io->buf_fill) {
-    if (ne_io_seek(io, saved_pos, NESTEGG_SEEK_SET) != 0)
-      return -1;
+  io->fill_start = saved_pos;
+  io->fill_end = pos;
+
+  if (length > io->buf_fill - io->buf_offset)
     return io_error ? -1 : 0;
-  }
   if (io_error) {
     /* The underlying stream position is unknown after the failed
        read.  Poison the IO so that ne_io_tell returns -1 until
@@ -893,6 +1466,9 @@ ne_io_read(ne_io * io, void * buffer, size_t length)
   size_t buffered;
   unsigned char * out = buffer;
 
+  if (io->mem)
+    return ne_io_mem_read(io, out, length);
+
   /* Fast path: request satisfied entirely from the buffer.
      This is safe even when poisoned because the buffered bytes
      were read before the error and are still valid. */
@@ -903,25 +1479,28 @@ ne_io_read(ne_io * io, void * buffer, size_t length)
   if (io->poisoned)
     return -1;
 
-  /* The buffer cannot satisfy the full request.  Seek back to the
-     logical position (before any buffered-but-unconsumed bytes),
-     invalidate the buffer, and read from the callback directly.
-     This avoids partially draining the buffer and then failing,
-     which would violate the all-or-nothing read contract. */
-  if (buffered > 0) {
-    if (ne_io_rewind_to_logical_pos(io) != 0)
+  /* Large reads bypass the buffer.  Take what is buffered, drop the
+     buffer, and read the rest from the callback directly.  Seek back on
+     failure to preserve the all-or-nothing read contract. */
+  if (length >= io->buf_size) {
+    int64_t start = ne_io_tell(io);
+    int r;
+
+    if (start < 0)
       return -1;
+    memcpy(out, io->buf + io->buf_offset, buffered);
+    io->buf_offset = 0;
+    io->buf_fill = 0;
+    r = ne_io_read_direct(io, out + buffered, length - buffered);
+    if (r != 1 && buffered > 0) {
+      if (ne_io_seek(io, start, NESTEGG_SEEK_SET) != 0)
+        return -1;
+    }
+    return r;
   }
 
-  /* Large reads bypass the buffer.  Save the position so we can
-     rewind on failure to preserve the all-or-nothing contract. */
-  if (length >= IO_BUFFER_SIZE)
-    return ne_io_read_direct(io, out, length);
-
-  /* Refill the buffer, looping to handle short reads.  Cap the
-     request to max_offset to avoid reading past the parse fence.
-     Save position so we can rewind on failure, matching the
-     all-or-nothing contract of the large-read path above. */
+  /* Top up the buffer, looping to handle short reads.  The request is
+     capped to max_offset to avoid reading past the parse fence. */
   {
     int r = ne_io_fill_buffer(io, length);
     if (r != 1)
@@ -931,63 +1510,359 @@ ne_io_read(ne_io * io, void * buffer, size_t length)
   return ne_io_read_from_buffer(io, out, length);
 }
 
-static int
-ne_io_read_skip(ne_io * io, size_t length)
+/* Advance past length bytes of the destinations starting at iov[first],
+   returning the index of the first destination with bytes left. */
+static unsigned int
+ne_io_iov_advance(nestegg_iovec * iov, unsigned int count, unsigned int first,
+                  size_t length)
 {
-  size_t get;
-  unsigned char buf[IO_BUFFER_SIZE];
-  int r = 1;
-
-  while (length > 0) {
-    get = length < sizeof(buf) ? length : sizeof(buf);
-    r = ne_io_read(io, buf, get);
-    if (r != 1)
+  while (first < count) {
+    size_t n = iov[first].length < length ? iov[first].length : length;
+    iov[first].base = (unsigned char *) iov[first].base + n;
+    iov[first].length -= n;
+    length -= n;
+    if (iov[first].length > 0)
       break;
-    length -= get;
+    first += 1;
   }
-
-  return r;
+  assert(length == 0);
+  return first;
 }
 
+/* Read into count destinations in order, with the same all-or-nothing
+   contract as ne_io_read over their total length.  Reads that extend
+   beyond the buffer by at least a buffer's worth are issued as scatter
+   requests to the vectored read callback so each payload lands in its
+   destination without an intermediate copy; anything else is read one
+   destination at a time.  The destinations are consumed as they are
+   filled. */
 static int
-ne_bare_read_vint(ne_io * io, uint64_t * value, uint64_t * length, enum vint_mask maskflag)
+ne_io_readv(ne_io * io, nestegg_iovec * iov, unsigned int count)
 {
-  int r;
-  unsigned char b;
-  size_t maxlen = 8;
-  unsigned int count = 1, mask = 1 << 7;
+  uint64_t total = 0;
+  size_t buffered;
+  unsigned int i;
+  int64_t start;
+  int64_t r;
 
-  r = ne_io_read(io, &b, 1);
-  if (r != 1)
-    return r;
+  for (i = 0; i < count; ++i)
+    total += iov[i].length;
 
-  while (count < maxlen) {
-    if ((b & mask) != 0)
-      break;
-    mask >>= 1;
-    count += 1;
+  buffered = io->buf_fill - io->buf_offset;
+  start = io->readv && !io->mem ? ne_io_tell(io) : -1;
+  if (start < 0 || total < buffered + io->buf_size ||
+      (io->max_offset > 0 && start + (int64_t) total > io->max_offset)) {
+    for (i = 0; i < count; ++i) {
+      int rr = ne_io_read(io, iov[i].base, iov[i].length);
+      if (rr != 1)
+        return rr;
+    }
+    return 1;
   }
 
-  if (length)
-    *length = count;
-  *value = b;
-
-  if (maskflag == MASK_FIRST_BIT)
-    *value = b & ~mask;
+  /* Take what is buffered, then drop the buffer so the callback stream
+     position is the logical position. */
+  i = 0;
+  while (buffered > 0) {
+    size_t n = iov[i].length < buffered ? iov[i].length : buffered;
+    memcpy(iov[i].base, io->buf + io->buf_offset, n);
+    io->buf_offset += n;
+    buffered -= n;
+    total -= n;
+    i = ne_io_iov_advance(iov, count, i, n);
+  }
+  io->buf_offset = 0;
+  io->buf_fill = 0;
 
-  while (--count) {
-    r = ne_io_read(io, &b, 1);
-    if (r != 1)
-      return r;
-    *value <<= 8;
-    *value |= b;
+  while (total > 0) {
+    r = io->readv(iov + i, count - i, io->io->userdata);
+    io->stats.read_calls += 1;
+    if (r <= 0 || (uint64_t) r > total) {
+      /* Only a clean end of stream leaves the position known. */
+      if (r != 0)
+        io->pos = -1;
+      if (ne_io_seek(io, start, NESTEGG_SEEK_SET) != 0)
+        return -1;
+      return r == 0 ? 0 : -1;
+    }
+    io->stats.read_bytes += r;
+    io->pos += r;
+    total -= r;
+    i = ne_io_iov_advance(iov, count, i, (size_t) r);
   }
 
   return 1;
 }
 
+/* Skip length bytes with a forward seek instead of reading them.  Returns
+   0 without moving if the skip would cross max_offset or the seek callback
+   fails, in which case the caller falls back to reading. */
 static int
-ne_read_id(ne_io * io, uint64_t * value, uint64_t * length)
+ne_io_skip_by_seek(ne_io * io, size_t length)
+{
+  int64_t pos;
+  int64_t target;
+  int r;
+
+  pos = ne_io_tell(io);
+  if (pos < 0)
+    return 0;
+  if ((uint64_t) length > (uint64_t) (INT64_MAX - pos))
+    return 0;
+  target = pos + (int64_t) length;
+  if (io->max_offset > 0 && target > io->max_offset)
+    return 0;
+
+  r = io->io->seek(target, NESTEGG_SEEK_SET, io->io->userdata);
+  io->stats.seek_calls += 1;
+  if (r != 0) {
+    /* Restore the logical position with a real seek in case the
+       callback moved the stream before failing. */
+    io->pos = -1;
+    if (ne_io_seek(io, pos, NESTEGG_SEEK_SET) != 0)
+      return -1;
+    return 0;
+  }
+  io->stats.skip_seeks += 1;
+  io->buf_offset = 0;
+  io->buf_fill = 0;
+  io->pos = target;
+  return 1;
+}
+
+static int
+ne_io_read_skip(ne_io * io, size_t length)
+{
+  size_t get;
+  size_t buffered;
+  unsigned char buf[IO_BUFFER_SIZE];
+  int r = 1;
+
+  if (io->mem) {
+    if (io->poisoned)
+      return -1;
+    if ((uint64_t) length > ne_io_mem_available(io))
+      return 0;
+    io->mem_pos += length;
+    return 1;
+  }
+
+  buffered = io->buf_fill - io->buf_offset;
+  if (length <= buffered) {
+    io->buf_offset += length;
+    return 1;
+  }
+
+  if (io->skip_threshold > 0 && !io->poisoned &&
+      length - buffered >= io->skip_threshold) {
+    r = ne_io_skip_by_seek(io, length);
+    if (r != 0)
+      return r;
+    r = 1;
+  }
+
+  while (length > 0) {
+    get = length < sizeof(buf) ? length : sizeof(buf);
+    r = ne_io_read(io, buf, get);
+    if (r != 1)
+      break;
+    length -= get;
+  }
+
+  return r;
+}
+
+/* Borrow length bytes at the current position of a memory-backed stream
+   instead of copying them out.  The returned pointer remains valid for
+   as long as the memory backing the stream. */
+static int
+ne_io_read_view(ne_io * io, unsigned char const ** out, size_t length)
+{
+  assert(ne_io_mem_is_whole(io));
+  if (io->poisoned)
+    return -1;
+  if ((uint64_t) length > ne_io_mem_available(io))
+    return 0;
+  *out = io->mem + io->mem_pos;
+  io->mem_pos += length;
+  return 1;
+}
+
+/* Expose the bytes at the current position that are already in memory,
+   either buffered or in the window of a memory-backed stream, so small
+   values can be decoded in place.  Returns the number of bytes at *p,
+   which may be fewer than remain in the stream. */
+static size_t
+ne_io_peek(ne_io * io, unsigned char const ** p)
+{
+  size_t n;
+  uint64_t available;
+
+  if (!io->mem) {
+    *p = io->buf + io->buf_offset;
+    return io->buf_fill - io->buf_offset;
+  }
+  if (io->poisoned || io->mem_pos < io->mem_base ||
+      io->mem_pos - io->mem_base >= (int64_t) io->mem_length)
+    return 0;
+  n = io->mem_length - (size_t) (io->mem_pos - io->mem_base);
+  available = ne_io_mem_available(io);
+  if ((uint64_t) n > available)
+    n = (size_t) available;
+  *p = io->mem + (io->mem_pos - io->mem_base);
+  return n;
+}
+
+/* As ne_io_peek, but fill the buffer or move the window of a
+   memory-backed stream first if no bytes at the current position are in
+   memory.  Returns 1 if some are exposed, 0 at the end of the stream, -1
+   on error. */
+static int
+ne_io_peek_fill(ne_io * io, unsigned char const ** p, size_t * n)
+{
+  int r;
+
+  *n = ne_io_peek(io, p);
+  if (*n > 0)
+    return 1;
+  if (io->poisoned)
+    return -1;
+  if (io->mem) {
+    if (ne_io_mem_available(io) == 0)
+      return 0;
+    if (ne_io_mem_remap(io, io->mem_pos) != 0)
+      return -1;
+  } else {
+    r = ne_io_fill_buffer(io, 1);
+    if (r != 1)
+      return r;
+  }
+  *n = ne_io_peek(io, p);
+  return *n > 0 ? 1 : -1;
+}
+
+/* Consume length bytes exposed by ne_io_peek. */
+static void
+ne_io_consume(ne_io * io, size_t length)
+{
+  if (io->mem) {
+    io->mem_pos += length;
+  } else {
+    io->buf_offset += length;
+    assert(io->buf_fill >= io->buf_offset);
+  }
+}
+
+/* Length in bytes of the vint starting with b, from its leading zeros.
+   A zero byte is taken as the start of an 8 byte vint. */
+static unsigned int
+ne_vint_length(unsigned char b)
+{
+#if defined(__GNUC__)
+  if (b == 0)
+    return 8;
+  return (unsigned int) __builtin_clz(b) - (sizeof(unsigned int) - 1) * 8 + 1;
+#else
+  unsigned int count = 1, mask = 1 << 7;
+
+  while (count < 8 && (b & mask) == 0) {
+    mask >>= 1;
+    count += 1;
+  }
+  return count;
+#endif
+}
+
+/* Load a big-endian value of length bytes, 1 to 8, from p.  With 8 bytes
+   available the load is done as a single 64-bit load and shift. */
+static uint64_t
+ne_load_be(unsigned char const * p, size_t avail, unsigned int length)
+{
+  uint64_t value = 0;
+  unsigned int i;
+
+  assert(length >= 1 && length <= 8 && avail >= length);
+  if (avail >= 8) {
+    for (i = 0; i < 8; ++i)
+      value = (value << 8) | p[i];
+    return value >> (64 - 8 * length);
+  }
+  for (i = 0; i < length; ++i)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+/* Decode a vint from the first avail bytes at p, as ne_bare_read_vint.
+   Returns 0 if avail is too short to hold the whole vint. */
+static int
+ne_decode_vint(unsigned char const * p, size_t avail, uint64_t * value,
+               uint64_t * length, enum vint_mask maskflag)
+{
+  unsigned int count;
+
+  if (avail == 0)
+    return 0;
+
+  count = ne_vint_length(p[0]);
+  if (avail < count)
+    return 0;
+
+  if (length)
+    *length = count;
+  *value = ne_load_be(p, avail, count);
+
+  if (maskflag == MASK_FIRST_BIT)
+    *value &= ~((uint64_t) (1 << 7 >> (count - 1)) << 8 * (count - 1));
+
+  return 1;
+}
+
+static int
+ne_bare_read_vint(ne_io * io, uint64_t * value, uint64_t * length, enum vint_mask maskflag)
+{
+  int r;
+  unsigned char b;
+  unsigned char const * p;
+  size_t avail;
+  uint64_t count;
+  unsigned int mask = 1 << 7;
+
+  /* Decode in place when the whole vint is in memory. */
+  avail = ne_io_peek(io, &p);
+  if (ne_decode_vint(p, avail, value, &count, maskflag)) {
+    ne_io_consume(io, (size_t) count);
+    if (length)
+      *length = count;
+    return 1;
+  }
+
+  r = ne_io_read(io, &b, 1);
+  if (r != 1)
+    return r;
+
+  count = ne_vint_length(b);
+  mask >>= count - 1;
+
+  if (length)
+    *length = count;
+  *value = b;
+
+  if (maskflag == MASK_FIRST_BIT)
+    *value = b & ~mask;
+
+  while (--count) {
+    r = ne_io_read(io, &b, 1);
+    if (r != 1)
+      return r;
+    *value <<= 8;
+    *value |= b;
+  }
+
+  return 1;
+}
+
+static int
+ne_read_id(ne_io * io, uint64_t * value, uint64_t * length)
 {
   return ne_bare_read_vint(io, value, length, MASK_NONE);
 }
@@ -1024,10 +1899,20 @@ static int
 ne_read_uint(ne_io * io, uint64_t * val, uint64_t length)
 {
   unsigned char b;
+  unsigned char const * p;
+  size_t avail;
   int r;
 
   if (length == 0 || length > 8)
     return -1;
+
+  avail = ne_io_peek(io, &p);
+  if (avail >= length) {
+    *val = ne_load_be(p, avail, (unsigned int) length);
+    ne_io_consume(io, (size_t) length);
+    return 1;
+  }
+
   r = ne_io_read(io, &b, 1);
   if (r != 1)
     return r;
@@ -1185,29 +2070,82 @@ ne_get_binary(struct ebml_type type, struct ebml_binary * value)
   return 0;
 }
 
-static int
-ne_is_ancestor_element(uint64_t id, struct list_node * ancestor)
+static unsigned int
+ne_dispatch_id_slot(struct ne_dispatch const * d, uint64_t id)
 {
-  struct ebml_element_desc * element;
+  unsigned int slot = (unsigned int) ((id * 0x9E3779B97F4A7C15ULL) >> 56) % DISPATCH_ID_SLOTS;
+
+  while (d->ids[slot].id && d->ids[slot].id != id)
+    slot = (slot + 1) % DISPATCH_ID_SLOTS;
+  return slot;
+}
 
-  for (; ancestor; ancestor = ancestor->previous)
-    for (element = ancestor->node; element->id; ++element)
-      if (element->id == id)
-        return 1;
+static unsigned int
+ne_dispatch_table_slot(struct ne_dispatch const * d, struct ebml_element_desc const * elements)
+{
+  unsigned int slot = (unsigned int) (((size_t) elements / sizeof(*elements)) % DISPATCH_TABLE_SLOTS);
 
-  return 0;
+  while (d->tables[slot].elements && d->tables[slot].elements != elements)
+    slot = (slot + 1) % DISPATCH_TABLE_SLOTS;
+  return slot;
 }
 
-static struct ebml_element_desc *
-ne_find_element(uint64_t id, struct ebml_element_desc * elements)
+/* Index elements and, depth first, the tables of its master elements. */
+static void
+ne_dispatch_add_table(struct ne_dispatch * d, struct ebml_element_desc * elements)
 {
   struct ebml_element_desc * element;
+  struct ne_dispatch_table * table;
+  struct ne_dispatch_id * entry;
+  unsigned int slot;
+
+  slot = ne_dispatch_table_slot(d, elements);
+  table = &d->tables[slot];
+  assert(!table->elements);
+  table->elements = elements;
+  table->enter = d->count++;
+
+  for (element = elements; element->id; ++element) {
+    entry = &d->ids[ne_dispatch_id_slot(d, element->id)];
+    assert(!entry->id);
+    entry->id = element->id;
+    entry->element = element;
+    entry->parent = slot;
+    if (element->children)
+      ne_dispatch_add_table(d, element->children);
+  }
 
-  for (element = elements; element->id; ++element)
-    if (element->id == id)
-      return element;
+  table->leave = d->count;
+}
 
-  return NULL;
+static struct ne_dispatch_id const *
+ne_dispatch_find(struct ne_dispatch const * d, uint64_t id)
+{
+  struct ne_dispatch_id const * entry = &d->ids[ne_dispatch_id_slot(d, id)];
+  return entry->id ? entry : NULL;
+}
+
+static int
+ne_is_ancestor_element(nestegg * ctx, uint64_t id, struct list_node * node)
+{
+  struct ne_dispatch_id const * entry = ne_dispatch_find(&ctx->dispatch, id);
+  struct ne_dispatch_table const * table, * parent;
+
+  if (!entry)
+    return 0;
+  table = &ctx->dispatch.tables[node->table];
+  parent = &ctx->dispatch.tables[entry->parent];
+  return parent->enter < table->enter && table->leave <= parent->leave;
+}
+
+static struct ebml_element_desc *
+ne_find_element(nestegg * ctx, uint64_t id, struct list_node * node)
+{
+  struct ne_dispatch_id const * entry = ne_dispatch_find(&ctx->dispatch, id);
+
+  if (!entry || entry->parent != node->table)
+    return NULL;
+  return entry->element;
 }
 
 static int
@@ -1215,11 +2153,15 @@ ne_ctx_push(nestegg * ctx, struct ebml_element_desc * ancestor, void * data)
 {
   struct list_node * item;
 
-  item = ne_alloc(sizeof(*item));
-  if (!item)
+  /* Pushes follow the descriptor tree, so the depth is bounded by its
+     height. */
+  if (ctx->ancestor_depth == ANCESTOR_STACK_DEPTH)
     return -1;
+  item = &ctx->ancestor_stack[ctx->ancestor_depth++];
   item->previous = ctx->ancestor;
   item->node = ancestor;
+  item->table = ne_dispatch_table_slot(&ctx->dispatch, ancestor);
+  assert(ctx->dispatch.tables[item->table].elements == ancestor);
   item->data = data;
   ctx->ancestor = item;
   return 0;
@@ -1232,7 +2174,8 @@ ne_ctx_pop(nestegg * ctx)
 
   item = ctx->ancestor;
   ctx->ancestor = item->previous;
-  free(item);
+  assert(item == &ctx->ancestor_stack[ctx->ancestor_depth - 1]);
+  ctx->ancestor_depth -= 1;
 }
 
 static int
@@ -1252,15 +2195,17 @@ ne_ctx_restore(nestegg * ctx, struct saved_state * s)
 {
   int r;
 
-  /* A failed restore leaves the logical stream position unknown, so any
-     cached lookahead must be discarded as well. */
+  /* A failed restore leaves the logical stream position unknown, so the
+     stream is poisoned until the next successful seek and any cached
+     lookahead must be discarded as well. */
   ctx->last_valid = 0;
 
-  if (s->stream_offset < 0)
-    return -1;
-  r = ne_io_seek(&ctx->io, s->stream_offset, NESTEGG_SEEK_SET);
-  if (r != 0)
+  r = s->stream_offset < 0 ? -1 :
+      ne_io_seek(&ctx->io, s->stream_offset, NESTEGG_SEEK_SET);
+  if (r != 0) {
+    ctx->io.poisoned = 1;
     return -1;
+  }
   ctx->last_id = s->last_id;
   ctx->last_size = s->last_size;
   ctx->last_valid = s->last_valid;
@@ -1434,7 +2379,7 @@ ne_parse(nestegg * ctx, struct ebml_element_desc * top_level, int64_t max_offset
       break;
     peeked_id = id;
 
-    element = ne_find_element(id, ctx->ancestor->node);
+    element = ne_find_element(ctx, id, ctx->ancestor);
     if (element) {
       if (element->flags & DESC_FLAG_SUSPEND) {
         assert(element->id == ID_CLUSTER && element->type == TYPE_MASTER);
@@ -1471,7 +2416,7 @@ ne_parse(nestegg * ctx, struct ebml_element_desc * top_level, int64_t max_offset
         if (r < 0)
           break;
       }
-    } else if (ne_is_ancestor_element(id, ctx->ancestor->previous)) {
+    } else if (ne_is_ancestor_element(ctx, id, ctx->ancestor)) {
       ctx->log(ctx, NESTEGG_LOG_DEBUG, "parent element %llx", id);
       if (top_level && ctx->ancestor->node == top_level) {
         ctx->log(ctx, NESTEGG_LOG_DEBUG, "*** parse about to back up past top_level");
@@ -1689,6 +2634,25 @@ ne_read_ebml_lacing(ne_io * io, size_t block, size_t * read, uint64_t n, uint64_
   return 1;
 }
 
+/* Returns non-zero if 'size' equals the EBML unknown-size pattern for any VINT
+   length. Patterns (data bits all 1): 0x7F, 0x3FFF, 0x1FFFFF, 0x0FFFFFFF,
+   0x07FFFFFFFF, 0x03FFFFFFFFFF, 0x01FFFFFFFFFFFF, 0x00FFFFFFFFFFFFFF. */
+static int
+ne_size_is_unknown(uint64_t size)
+{
+  int len;
+  for (len = 1; len <= 8; ++len) {
+    uint64_t mask;
+    if (len == 8)
+      mask = 0x00FFFFFFFFFFFFFFULL;  /* 56 data bits = all ones */
+    else
+      mask = (1ULL << (7 * len)) - 1ULL; /* 7 data bits per byte */
+    if (size == mask)
+      return 1;
+  }
+  return 0;
+}
+
 static uint64_t
 ne_saturate_mul_uint64(uint64_t a, uint64_t b)
 {
@@ -1757,88 +2721,224 @@ ne_find_track_entry(nestegg * ctx, unsigned int track)
   return NULL;
 }
 
-static struct frame *
-ne_alloc_frame(void)
+static struct ne_packet_pool *
+ne_packet_pool_init(nestegg_allocator const * a, size_t limit)
 {
-  struct frame * f = ne_alloc(sizeof(*f));
+  struct ne_packet_pool * pool = ne_alloc(a, sizeof(*pool));
 
-  if (!f)
+  if (!pool)
     return NULL;
 
-  f->data = NULL;
-  f->length = 0;
-  f->frame_encryption = NULL;
-  f->next = NULL;
+  pool->alloc = *a;
+  pool->refs = 1;
+  pool->limit = limit;
 
-  return f;
+  return pool;
 }
 
-static struct frame_encryption *
-ne_alloc_frame_encryption(void)
+/* Account for keeping size more bytes in the pool.  Returns 1 if they
+   fit within the limit and 0 if they should be freed instead. */
+static int
+ne_packet_pool_keep(struct ne_packet_pool * pool, size_t size)
 {
-  struct frame_encryption * f = ne_alloc(sizeof(*f));
-
-  if (!f)
-    return NULL;
+  if (size > pool->limit - pool->cached)
+    return 0;
+  pool->cached += size;
+  return 1;
+}
 
-  f->iv = NULL;
-  f->length = 0;
-  f->signal_byte = 0;
-  f->num_partitions = 0;
-  f->partition_offsets = NULL;
+static void
+ne_packet_pool_trim(struct ne_packet_pool * pool)
+{
+  unsigned int i;
 
-  return f;
+  while (pool->packets) {
+    nestegg_packet * pkt = pool->packets;
+    pool->packets = pkt->next;
+    ne_free(&pool->alloc, pkt);
+  }
+  while (pool->encryptions) {
+    struct frame_encryption * e = pool->encryptions;
+    pool->encryptions = e->next;
+    ne_free(&pool->alloc, e);
+  }
+  for (i = 0; i < PACKET_POOL_CLASSES; ++i) {
+    while (pool->payloads[i]) {
+      union ne_payload_header * h = pool->payloads[i];
+      pool->payloads[i] = h->h.next;
+      ne_free(&pool->alloc, h);
+    }
+  }
+  pool->cached = 0;
 }
 
 static void
-ne_free_frame(struct frame * f)
+ne_packet_pool_release(struct ne_packet_pool * pool)
 {
-  if (f->frame_encryption) {
-    free(f->frame_encryption->iv);
-    free(f->frame_encryption->partition_offsets);
-  }
+  assert(pool->refs > 0);
+  pool->refs -= 1;
+  if (pool->refs == 0) {
+    nestegg_allocator a = pool->alloc;
 
-  free(f->frame_encryption);
-  free(f->data);
-  free(f);
+    ne_packet_pool_trim(pool);
+    ne_free(&a, pool);
+  }
 }
 
-static int
-ne_read_block(nestegg * ctx, uint64_t block_id, uint64_t block_size, nestegg_packet ** data)
+/* Allocate an uninitialized payload buffer of at least size bytes. */
+static unsigned char *
+ne_alloc_payload(nestegg_allocator const * a, struct ne_packet_pool * pool, size_t size)
 {
-  int r;
-  int64_t timecode, abs_timecode;
-  nestegg_packet * pkt;
-  struct frame * f, * last;
-  struct track_entry * entry;
-  uint64_t track_number, length, frame_sizes[256], cluster_tc, flags, frames, tc_scale, total,
-           encoding_type, encryption_algo, encryption_mode;
-  unsigned int i, lacing, track;
-  uint8_t signal_byte, keyframe = NESTEGG_PACKET_HAS_KEYFRAME_UNKNOWN, j = 0;
-  size_t consumed = 0, data_size, encryption_size;
+  union ne_payload_header * h;
+  unsigned int c = 0;
 
-  *data = NULL;
+  if (!pool)
+    return ne_malloc(a, size);
 
-  if (block_size > LIMIT_BLOCK)
-    return -1;
+  while (c < PACKET_POOL_CLASSES && ((size_t) PACKET_POOL_MIN_PAYLOAD << c) < size)
+    c += 1;
 
-  r = ne_read_vint(&ctx->io, &track_number, &length);
-  if (r != 1)
-    return r;
+  if (c < PACKET_POOL_CLASSES && pool->payloads[c]) {
+    h = pool->payloads[c];
+    pool->payloads[c] = h->h.next;
+    pool->cached -= (size_t) PACKET_POOL_MIN_PAYLOAD << c;
+    return (unsigned char *) (h + 1);
+  }
 
-  if (track_number == 0)
-    return -1;
+  h = ne_malloc(a, sizeof(*h) + (c < PACKET_POOL_CLASSES ? (size_t) PACKET_POOL_MIN_PAYLOAD << c : size));
+  if (!h)
+    return NULL;
+  h->h.size_class = c;
 
-  consumed += length;
+  return (unsigned char *) (h + 1);
+}
 
-  r = ne_read_int(&ctx->io, &timecode, 2);
-  if (r != 1)
-    return r;
+static void
+ne_free_payload(nestegg_allocator const * a, struct ne_packet_pool * pool, void * data)
+{
+  union ne_payload_header * h;
 
-  consumed += 2;
+  if (!pool || !data) {
+    ne_free(a, data);
+    return;
+  }
 
-  r = ne_read_uint(&ctx->io, &flags, 1);
-  if (r != 1)
+  h = (union ne_payload_header *) data - 1;
+  if (h->h.size_class < PACKET_POOL_CLASSES &&
+      ne_packet_pool_keep(pool, (size_t) PACKET_POOL_MIN_PAYLOAD << h->h.size_class)) {
+    h->h.next = pool->payloads[h->h.size_class];
+    pool->payloads[h->h.size_class] = h;
+    return;
+  }
+
+  ne_free(a, h);
+}
+
+static nestegg_packet *
+ne_alloc_packet(nestegg_allocator const * a, struct ne_packet_pool * pool)
+{
+  nestegg_packet * pkt;
+
+  if (pool && pool->packets) {
+    pkt = pool->packets;
+    pool->packets = pkt->next;
+    pool->cached -= sizeof(*pkt);
+    memset(pkt, 0, sizeof(*pkt));
+  } else {
+    pkt = ne_alloc(a, sizeof(*pkt));
+    if (!pkt)
+      return NULL;
+  }
+
+  pkt->frames = pkt->frame_storage;
+  pkt->pool = pool;
+  pkt->alloc = *a;
+  if (pool)
+    pool->refs += 1;
+
+  return pkt;
+}
+
+static struct frame_encryption *
+ne_alloc_frame_encryption(nestegg_allocator const * a, struct ne_packet_pool * pool)
+{
+  struct frame_encryption * f;
+
+  if (pool && pool->encryptions) {
+    f = pool->encryptions;
+    pool->encryptions = f->next;
+    pool->cached -= sizeof(*f);
+  } else {
+    f = ne_alloc(a, sizeof(*f));
+    if (!f)
+      return NULL;
+  }
+
+  f->length = 0;
+  f->signal_byte = 0;
+  f->num_partitions = 0;
+  f->partition_offsets = NULL;
+  f->next = NULL;
+
+  return f;
+}
+
+static void
+ne_free_frame_encryption(nestegg_allocator const * a, struct ne_packet_pool * pool,
+                         struct frame_encryption * e)
+{
+  ne_free_payload(a, pool, e->partition_offsets);
+  if (pool && ne_packet_pool_keep(pool, sizeof(*e))) {
+    e->next = pool->encryptions;
+    pool->encryptions = e;
+  } else {
+    ne_free(a, e);
+  }
+}
+
+static int
+ne_read_block(nestegg * ctx, uint64_t block_id, uint64_t block_size,
+              struct ne_packet_dest const * dest, nestegg_packet ** data)
+{
+  int r;
+  int64_t timecode, abs_timecode;
+  nestegg_packet * pkt;
+  struct ne_packet_pool * pool = ctx->packet_pool;
+  nestegg_packet_chunk * f;
+  struct frame_encryption * e;
+  struct track_entry * entry;
+  uint64_t track_number, length, frame_sizes[256], cluster_tc, flags, frames, tc_scale, total,
+           encoding_type, encryption_algo, encryption_mode;
+  unsigned int i, lacing, track;
+  uint8_t signal_byte, keyframe = NESTEGG_PACKET_HAS_KEYFRAME_UNKNOWN, j = 0;
+  size_t consumed = 0, data_size, encryption_size, payload_used = 0, payload_capacity;
+  unsigned char * payload;
+  int borrow;
+  nestegg_iovec iov[256];
+  unsigned int iov_count = 0;
+
+  *data = NULL;
+
+  if (block_size > LIMIT_BLOCK)
+    return -1;
+
+  r = ne_read_vint(&ctx->io, &track_number, &length);
+  if (r != 1)
+    return r;
+
+  if (track_number == 0)
+    return -1;
+
+  consumed += length;
+
+  r = ne_read_int(&ctx->io, &timecode, 2);
+  if (r != 1)
+    return r;
+
+  consumed += 2;
+
+  r = ne_read_uint(&ctx->io, &flags, 1);
+  if (r != 1)
     return r;
 
   consumed += 1;
@@ -1944,7 +3044,7 @@ ne_read_block(nestegg * ctx, uint64_t block_id, uint64_t block_size, nestegg_pac
       abs_timecode = 0;
   }
 
-  pkt = ne_alloc(sizeof(*pkt));
+  pkt = ne_alloc_packet(&ctx->alloc, pool);
   if (!pkt)
     return -1;
   pkt->track = track;
@@ -1954,14 +3054,32 @@ ne_read_block(nestegg * ctx, uint64_t block_id, uint64_t block_size, nestegg_pac
   ctx->log(ctx, NESTEGG_LOG_DEBUG, "%sblock t %lld pts %f f %llx frames: %llu",
            block_id == ID_BLOCK ? "" : "simple", pkt->track, pkt->timecode / 1e9, flags, frames);
 
-  last = NULL;
-  for (i = 0; i < frames; ++i) {
-    if (frame_sizes[i] > LIMIT_FRAME) {
+  if (frames > 1) {
+    pkt->frames = (nestegg_packet_chunk *) ne_alloc_payload(&ctx->alloc, pool, frames * sizeof(*pkt->frames));
+    if (!pkt->frames) {
       nestegg_free_packet(pkt);
       return -1;
     }
-    f = ne_alloc_frame();
-    if (!f) {
+  }
+
+  /* Unless the payloads are borrowed from the source or the caller, they
+     share one buffer sized for all frames, which is fully overwritten by
+     the read and so is not zero-filled. */
+  borrow = dest->view && ne_io_mem_is_whole(&ctx->io);
+  payload = dest->buf;
+  payload_capacity = dest->capacity;
+  if (!borrow && !payload) {
+    pkt->payload = ne_alloc_payload(&ctx->alloc, pool, total - consumed);
+    if (!pkt->payload) {
+      nestegg_free_packet(pkt);
+      return -1;
+    }
+    payload = pkt->payload;
+    payload_capacity = total - consumed;
+  }
+
+  for (i = 0; i < frames; ++i) {
+    if (frame_sizes[i] > LIMIT_FRAME) {
       nestegg_free_packet(pkt);
       return -1;
     }
@@ -1969,57 +3087,53 @@ ne_read_block(nestegg * ctx, uint64_t block_id, uint64_t block_size, nestegg_pac
     if (encoding_type == NESTEGG_ENCODING_ENCRYPTION) {
       r = ne_io_read(&ctx->io, &signal_byte, SIGNAL_BYTE_SIZE);
       if (r != 1) {
-        ne_free_frame(f);
         nestegg_free_packet(pkt);
         return r;
       }
-      f->frame_encryption = ne_alloc_frame_encryption();
-      if (!f->frame_encryption) {
-        ne_free_frame(f);
+      pkt->encryption = e = ne_alloc_frame_encryption(&ctx->alloc, pool);
+      if (!e) {
         nestegg_free_packet(pkt);
         return -1;
       }
-      f->frame_encryption->signal_byte = signal_byte;
+      e->signal_byte = signal_byte;
       if ((signal_byte & ENCRYPTED_BIT_MASK) == PACKET_ENCRYPTED) {
-        f->frame_encryption->iv = ne_alloc(IV_SIZE);
-        if (!f->frame_encryption->iv) {
-          ne_free_frame(f);
-          nestegg_free_packet(pkt);
-          return -1;
-        }
-        r = ne_io_read(&ctx->io, f->frame_encryption->iv, IV_SIZE);
+        r = ne_io_read(&ctx->io, e->iv, IV_SIZE);
         if (r != 1) {
-          ne_free_frame(f);
           nestegg_free_packet(pkt);
           return r;
         }
-        f->frame_encryption->length = IV_SIZE;
+        e->length = IV_SIZE;
         encryption_size = SIGNAL_BYTE_SIZE + IV_SIZE;
 
         if ((signal_byte & PARTITIONED_BIT_MASK) == PACKET_PARTITIONED) {
-          r = ne_io_read(&ctx->io, &f->frame_encryption->num_partitions, NUM_PACKETS_SIZE);
+          r = ne_io_read(&ctx->io, &e->num_partitions, NUM_PACKETS_SIZE);
           if (r != 1) {
-            ne_free_frame(f);
             nestegg_free_packet(pkt);
             return r;
           }
 
-          encryption_size += NUM_PACKETS_SIZE + f->frame_encryption->num_partitions * PACKET_OFFSET_SIZE;
-          f->frame_encryption->partition_offsets = ne_alloc(f->frame_encryption->num_partitions * PACKET_OFFSET_SIZE);
+          encryption_size += NUM_PACKETS_SIZE + e->num_partitions * PACKET_OFFSET_SIZE;
+          if (e->num_partitions > 0) {
+            e->partition_offsets =
+              (uint32_t *) ne_alloc_payload(&ctx->alloc, pool, e->num_partitions * PACKET_OFFSET_SIZE);
+            if (!e->partition_offsets) {
+              nestegg_free_packet(pkt);
+              return -1;
+            }
+          }
 
-          for (j = 0; j < f->frame_encryption->num_partitions; ++j) {
+          for (j = 0; j < e->num_partitions; ++j) {
             uint64_t value = 0;
             r = ne_read_uint(&ctx->io, &value, PACKET_OFFSET_SIZE);
             if (r != 1) {
               break;
             }
 
-            f->frame_encryption->partition_offsets[j] = (uint32_t) value;
+            e->partition_offsets[j] = (uint32_t) value;
           }
 
           /* If any of the partition offsets did not return 1, then fail. */
-          if (j != f->frame_encryption->num_partitions) {
-            ne_free_frame(f);
+          if (j != e->num_partitions) {
             nestegg_free_packet(pkt);
             return r;
           }
@@ -2031,31 +3145,45 @@ ne_read_block(nestegg * ctx, uint64_t block_id, uint64_t block_size, nestegg_pac
       encryption_size = 0;
     }
     if (encryption_size > frame_sizes[i]) {
-      ne_free_frame(f);
       nestegg_free_packet(pkt);
       return -1;
     }
     data_size = frame_sizes[i] - encryption_size;
     /* Encryption parsed */
-    f->data = ne_alloc(data_size);
-    if (!f->data) {
-      ne_free_frame(f);
-      nestegg_free_packet(pkt);
-      return -1;
-    }
+    f = &pkt->frames[i];
     f->length = data_size;
-    r = ne_io_read(&ctx->io, f->data, data_size);
+    if (borrow) {
+      unsigned char const * p;
+      r = ne_io_read_view(&ctx->io, &p, data_size);
+      if (r != 1) {
+        nestegg_free_packet(pkt);
+        return r;
+      }
+      f->data = (unsigned char *) p;
+    } else {
+      if (data_size > payload_capacity - payload_used) {
+        ctx->log(ctx, NESTEGG_LOG_ERROR, "packet does not fit in the supplied buffer");
+        nestegg_free_packet(pkt);
+        return -1;
+      }
+      f->data = payload + payload_used;
+      payload_used += data_size;
+      /* The payloads are read together once every frame has its
+         place.  Encrypted blocks are never laced, so the encryption
+         headers read above are not interleaved with pending payloads. */
+      iov[iov_count].base = f->data;
+      iov[iov_count].length = data_size;
+      iov_count += 1;
+    }
+    pkt->frame_count += 1;
+  }
+
+  if (iov_count > 0) {
+    r = ne_io_readv(&ctx->io, iov, iov_count);
     if (r != 1) {
-      ne_free_frame(f);
       nestegg_free_packet(pkt);
       return r;
     }
-
-    if (!last)
-      pkt->frame = f;
-    else
-      last->next = f;
-    last = f;
   }
 
   *data = pkt;
@@ -2114,27 +3242,27 @@ ne_read_block_additions(nestegg * ctx, uint64_t block_size, struct block_additio
     while (1) {
       int64_t pos = ne_io_tell(&ctx->io);
       if (pos < 0) {
-        free(data);
+        ne_free(&ctx->alloc, data);
         return -1;
       }
       if (pos >= block_more_end)
         break;
       r = ne_read_element(ctx, &id, &size);
       if (r != 1) {
-        free(data);
+        ne_free(&ctx->alloc, data);
         return r;
       }
 
       if (id == ID_BLOCK_ADD_ID) {
         r = ne_read_uint(&ctx->io, &add_id, size);
         if (r != 1) {
-          free(data);
+          ne_free(&ctx->alloc, data);
           return r;
         }
 
         if (add_id == 0) {
           ctx->log(ctx, NESTEGG_LOG_ERROR, "Disallowed BlockAddId 0 used");
-          free(data);
+          ne_free(&ctx->alloc, data);
           return -1;
         }
       } else if (id == ID_BLOCK_ADDITIONAL) {
@@ -2143,7 +3271,7 @@ ne_read_block_additions(nestegg * ctx, uint64_t block_size, struct block_additio
              BlockMore. */
           ctx->log(ctx, NESTEGG_LOG_ERROR,
                    "Multiple BlockAdditional elements in a BlockMore");
-          free(data);
+          ne_free(&ctx->alloc, data);
           return -1;
         }
 
@@ -2153,12 +3281,12 @@ ne_read_block_additions(nestegg * ctx, uint64_t block_size, struct block_additio
           return -1;
         }
         if (data_size != 0) {
-          data = ne_alloc(data_size);
+          data = ne_malloc(&ctx->alloc, data_size);
           if (!data)
             return -1;
           r = ne_io_read(&ctx->io, data, data_size);
           if (r != 1) {
-            free(data);
+            ne_free(&ctx->alloc, data);
             return r;
           }
         }
@@ -2169,7 +3297,7 @@ ne_read_block_additions(nestegg * ctx, uint64_t block_size, struct block_additio
                    "unknown element %llx in BlockMore", id);
         r = ne_io_read_skip(&ctx->io, size);
         if (r != 1) {
-          free(data);
+          ne_free(&ctx->alloc, data);
           return r;
         }
       }
@@ -2181,7 +3309,11 @@ ne_read_block_additions(nestegg * ctx, uint64_t block_size, struct block_additio
       return -1;
     }
 
-    block_additional = ne_alloc(sizeof(*block_additional));
+    block_additional = ne_alloc(&ctx->alloc, sizeof(*block_additional));
+    if (!block_additional) {
+      ne_free(&ctx->alloc, data);
+      return -1;
+    }
     block_additional->next = *pkt_block_additional;
     block_additional->id = add_id;
     block_additional->data = data;
@@ -2236,338 +3368,717 @@ ne_find_seek_for_id(struct ebml_list_node * seek_head, uint64_t id)
   return NULL;
 }
 
-static struct cue_track_positions *
-ne_find_cue_position_for_track(nestegg * ctx, struct ebml_list_node * node, unsigned int track)
+static int
+ne_cue_sort_compare(void const * a, void const * b)
 {
-  struct cue_track_positions * pos = NULL;
-  uint64_t track_number;
-  unsigned int t;
+  struct ne_cue_sort const * x = a;
+  struct ne_cue_sort const * y = b;
 
-  while (node) {
-    assert(node->id == ID_CUE_TRACK_POSITIONS);
-    pos = node->data;
-    if (ne_get_uint(pos->track, &track_number) != 0)
-      return NULL;
+  if (x->tstamp != y->tstamp)
+    return x->tstamp < y->tstamp ? -1 : 1;
+  return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
 
-    if (ne_map_track_number_to_index(ctx, track_number, &t) != 0)
-      return NULL;
+/* Sort the entries of one track in by_track by time, keeping file order
+   for equal times. */
+static int
+ne_cue_index_sort(nestegg * ctx, struct ne_cue_index * index, unsigned int * entries,
+                  unsigned int count)
+{
+  struct ne_cue_sort * sort;
+  unsigned int i;
 
-    if (t == track)
-      return pos;
+  for (i = 1; i < count; ++i)
+    if (index->tstamps[entries[i]] < index->tstamps[entries[i - 1]])
+      break;
+  if (i >= count)
+    return 0;
 
-    node = node->next;
+  sort = ne_malloc(&ctx->alloc, count * sizeof(*sort));
+  if (!sort)
+    return -1;
+  for (i = 0; i < count; ++i) {
+    sort[i].tstamp = index->tstamps[entries[i]];
+    sort[i].entry = entries[i];
   }
+  qsort(sort, count, sizeof(*sort), ne_cue_sort_compare);
+  for (i = 0; i < count; ++i)
+    entries[i] = sort[i].entry;
+  ne_free(&ctx->alloc, sort);
 
-  return NULL;
+  return 0;
 }
 
-static struct cue_point *
-ne_find_cue_point_for_tstamp(nestegg * ctx, struct ebml_list_node * cue_point, unsigned int track, uint64_t scale, uint64_t tstamp)
+/* Allocate an empty index with room for n entries. */
+static struct ne_cue_index *
+ne_cue_index_alloc(nestegg * ctx, unsigned int n)
 {
-  uint64_t time;
-  struct cue_point * c, * prev = NULL;
-
-  while (cue_point) {
-    assert(cue_point->id == ID_CUE_POINT);
-    c = cue_point->data;
-
-    if (!prev)
-      prev = c;
+  struct ne_cue_index * index;
 
-    if (ne_get_uint(c->time, &time) == 0 && time * scale > tstamp)
-      break;
-
-    if (ne_find_cue_position_for_track(ctx, c->cue_track_positions.head, track) != NULL)
-      prev = c;
-
-    cue_point = cue_point->next;
-  }
+  index = ne_pool_alloc(sizeof(*index), ctx->alloc_pool);
+  if (!index)
+    return NULL;
+  index->tstamps = ne_pool_alloc(n * sizeof(*index->tstamps), ctx->alloc_pool);
+  index->positions = ne_pool_alloc(n * sizeof(*index->positions), ctx->alloc_pool);
+  index->tracks = ne_pool_alloc(n * sizeof(*index->tracks), ctx->alloc_pool);
+  index->by_track = ne_pool_alloc(n * sizeof(*index->by_track), ctx->alloc_pool);
+  index->track_first = ne_pool_alloc((ctx->track_count + 1) * sizeof(*index->track_first),
+                                     ctx->alloc_pool);
+  if (!index->tstamps || !index->positions || !index->tracks || !index->by_track ||
+      !index->track_first)
+    return NULL;
 
-  return prev;
+  return index;
 }
 
 static void
-ne_null_log_callback(nestegg * ctx, unsigned int severity, char const * fmt, ...)
+ne_cue_index_add(struct ne_cue_index * index, uint64_t tstamp, uint64_t position,
+                 unsigned int track)
 {
-  if (ctx && severity && fmt)
-    return;
+  index->tstamps[index->count] = tstamp;
+  index->positions[index->count] = position;
+  index->tracks[index->count] = track;
+  index->track_first[track + 1] += 1;
+  index->count += 1;
 }
 
+/* Group the entries of index by track, sort each group by time and make
+   index the context's. */
 static int
-ne_init_cue_points(nestegg * ctx, int64_t max_offset)
+ne_cue_index_finish(nestegg * ctx, struct ne_cue_index * index)
 {
-  int r;
-  struct ebml_list_node * node = ctx->segment.cues.cue_point.head;
-  struct seek * found;
-  uint64_t seek_pos, id;
-  struct saved_state state;
-
-  /* If there are no cues loaded, check for cues element in the seek head
-     and load it. */
-  if (!node) {
-    found = ne_find_seek_for_id(ctx->segment.seek_head.head, ID_CUES);
-    if (!found)
-      return -1;
-
-    if (ne_get_uint(found->position, &seek_pos) != 0)
-      return -1;
-
-    /* Save old parser state. */
-    r = ne_ctx_save(ctx, &state);
-    if (r != 0)
-      return -1;
-
-    /* Seek and set up parser state for segment-level element (Cues). */
-    r = ne_io_seek(&ctx->io, ctx->segment_offset + seek_pos, NESTEGG_SEEK_SET);
-    if (r != 0)
-      return -1;
-    ctx->last_valid = 0;
-
-    r = ne_read_element(ctx, &id, NULL);
-    if (r != 1)
-      return -1;
-
-    if (id != ID_CUES)
-      return -1;
-
-    assert(ctx->ancestor == NULL);
-    if (ne_ctx_push(ctx, ne_top_level_elements, ctx) < 0)
-      return -1;
-    if (ne_ctx_push(ctx, ne_segment_elements, &ctx->segment) < 0)
-      return -1;
-    if (ne_ctx_push(ctx, ne_cues_elements, &ctx->segment.cues) < 0)
-      return -1;
-    /* parser will run until end of cues element. */
-    ctx->log(ctx, NESTEGG_LOG_DEBUG, "seek: parsing cue elements");
-    r = ne_parse_with_io_limit(ctx, ne_cues_elements, max_offset);
-    while (ctx->ancestor)
-      ne_ctx_pop(ctx);
+  unsigned int i, track, * fill;
 
-    /* Reset parser state to original state and seek back to old position. */
-    if (ne_ctx_restore(ctx, &state) != 0)
-      return -1;
-
-    if (r < 0)
-      return -1;
+  if (index->count == 0)
+    return -1;
 
-    node = ctx->segment.cues.cue_point.head;
-    if (!node)
+  /* Turn the per-track counts into offsets and distribute the entries. */
+  for (track = 0; track < ctx->track_count; ++track)
+    index->track_first[track + 1] += index->track_first[track];
+  fill = ne_malloc(&ctx->alloc, ctx->track_count * sizeof(*fill));
+  if (!fill)
+    return -1;
+  memcpy(fill, index->track_first, ctx->track_count * sizeof(*fill));
+  for (i = 0; i < index->count; ++i)
+    index->by_track[fill[index->tracks[i]]++] = i;
+  ne_free(&ctx->alloc, fill);
+
+  for (track = 0; track < ctx->track_count; ++track) {
+    if (ne_cue_index_sort(ctx, index, index->by_track + index->track_first[track],
+                          index->track_first[track + 1] - index->track_first[track]) != 0)
       return -1;
   }
 
+  ctx->cue_index = index;
   return 0;
 }
 
-/* Three functions that implement the nestegg_io interface, operating on a
-   io_buffer. */
-struct io_buffer {
-  unsigned char const * buffer;
-  size_t length;
-  int64_t offset;
-};
-
-static int64_t
-ne_buffer_read(void * buffer, size_t length, void * userdata)
+/* Flatten the parsed CuePoints into ctx->cue_index.  CueTrackPositions
+   missing a field or naming an unknown track are left out. */
+static int
+ne_cue_index_build(nestegg * ctx)
 {
-  struct io_buffer * iob = userdata;
-  size_t available = iob->length - iob->offset;
+  struct ne_cue_index * index;
+  struct ebml_list_node * node, * pos_node;
+  struct cue_point * c;
+  struct cue_track_positions * pos;
+  uint64_t tc_scale, time, track_number, cluster_position;
+  unsigned int n = 0, track;
 
-  if (available == 0)
-    return 0;
+  tc_scale = ne_get_timecode_scale(ctx);
+  if (tc_scale == 0)
+    return -1;
 
-  if (available < length)
+  for (node = ctx->segment.cues.cue_point.head; node; node = node->next) {
+    c = node->data;
+    for (pos_node = c->cue_track_positions.head; pos_node; pos_node = pos_node->next) {
+      if (n == UINT_MAX)
+        return -1;
+      n += 1;
+    }
+  }
+  if (n == 0)
     return -1;
 
-  memcpy(buffer, iob->buffer + iob->offset, length);
-  iob->offset += length;
+  index = ne_cue_index_alloc(ctx, n);
+  if (!index)
+    return -1;
 
-  return (int64_t) length;
+  for (node = ctx->segment.cues.cue_point.head; node; node = node->next) {
+    assert(node->id == ID_CUE_POINT);
+    c = node->data;
+    if (ne_get_uint(c->time, &time) != 0)
+      continue;
+    for (pos_node = c->cue_track_positions.head; pos_node; pos_node = pos_node->next) {
+      assert(pos_node->id == ID_CUE_TRACK_POSITIONS);
+      pos = pos_node->data;
+      if (ne_get_uint(pos->track, &track_number) != 0 ||
+          ne_get_uint(pos->cluster_position, &cluster_position) != 0 ||
+          ne_map_track_number_to_index(ctx, track_number, &track) != 0)
+        continue;
+      ne_cue_index_add(index, ne_saturate_mul_uint64(time, tc_scale), cluster_position, track);
+    }
+  }
+
+  return ne_cue_index_finish(ctx, index);
 }
 
+/* Find the last entry for track at or before tstamp, or the first entry
+   for track if all are later.  Returns -1 if track has no entries. */
 static int
-ne_buffer_seek(int64_t offset, int whence, void * userdata)
+ne_cue_index_find(struct ne_cue_index const * index, unsigned int track, uint64_t tstamp,
+                  unsigned int * entry)
 {
-  struct io_buffer * iob = userdata;
-  int64_t o = iob->offset;
-
-  switch(whence) {
-  case NESTEGG_SEEK_SET:
-    o = offset;
-    break;
-  case NESTEGG_SEEK_CUR:
-    o += offset;
-    break;
-  case NESTEGG_SEEK_END:
-    o = iob->length + offset;
-    break;
-  }
+  unsigned int const * entries = index->by_track + index->track_first[track];
+  unsigned int lo = 0, hi = index->track_first[track + 1] - index->track_first[track], mid;
 
-  if (o < 0 || o > (int64_t) iob->length)
+  if (hi == 0)
     return -1;
 
-  iob->offset = o;
+  /* Find the first entry later than tstamp. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (index->tstamps[entries[mid]] > tstamp)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  *entry = entries[lo > 0 ? lo - 1 : 0];
   return 0;
 }
 
-static int64_t
-ne_buffer_tell(void * userdata)
+static void
+ne_null_log_callback(nestegg * ctx, unsigned int severity, char const * fmt, ...)
 {
-  struct io_buffer * iob = userdata;
-  return iob->offset;
+  if (ctx && severity && fmt)
+    return;
 }
 
+/* Parse the Cues element at seek_pos.  The parser state is left for the
+   caller to restore. */
 static int
-ne_context_new(nestegg ** context, nestegg_io io, nestegg_log callback)
+ne_load_cue_points(nestegg * ctx, uint64_t seek_pos, int64_t max_offset)
 {
-  nestegg * ctx;
+  int r;
+  uint64_t id;
 
-  if (!(io.seek && io.tell && io.read))
+  /* Seek and set up parser state for segment-level element (Cues). */
+  r = ne_io_seek(&ctx->io, ctx->segment_offset + seek_pos, NESTEGG_SEEK_SET);
+  if (r != 0)
     return -1;
+  ctx->last_valid = 0;
 
-  ctx = ne_alloc(sizeof(*ctx));
-  if (!ctx)
+  r = ne_read_element(ctx, &id, NULL);
+  if (r != 1)
     return -1;
 
-  ctx->io.io = ne_alloc(sizeof(*ctx->io.io));
-  if (!ctx->io.io) {
-    nestegg_destroy(ctx);
-    return -1;
-  }
-  memcpy(ctx->io.io, &io, sizeof(io));
-  ctx->log = callback;
-  ctx->alloc_pool = ne_pool_init();
-  if (!ctx->alloc_pool) {
-    nestegg_destroy(ctx);
+  if (id != ID_CUES)
     return -1;
-  }
 
-  if (!ctx->log)
-    ctx->log = ne_null_log_callback;
-
-  *context = ctx;
-  return 0;
+  assert(ctx->ancestor == NULL);
+  if (ne_ctx_push(ctx, ne_top_level_elements, ctx) < 0)
+    return -1;
+  if (ne_ctx_push(ctx, ne_segment_elements, &ctx->segment) < 0)
+    return -1;
+  if (ne_ctx_push(ctx, ne_cues_elements, &ctx->segment.cues) < 0)
+    return -1;
+  /* parser will run until end of cues element. */
+  ctx->log(ctx, NESTEGG_LOG_DEBUG, "seek: parsing cue elements");
+  return ne_parse_with_io_limit(ctx, ne_cues_elements, max_offset);
 }
 
+/* Load the Cues, if not already loaded, and build ctx->cue_index.  Cues
+   found after the headers are parsed into a temporary pool that is freed
+   once the index is built, leaving only the index in memory. */
 static int
-ne_match_doc_type(nestegg_io io, int64_t max_offset, const char* doc_type)
+ne_init_cue_points(nestegg * ctx, int64_t max_offset)
 {
   int r;
-  uint64_t id;
-  char * doctype;
-  nestegg * ctx;
+  struct seek * found;
+  uint64_t seek_pos;
+  struct saved_state state;
+  struct pool_ctx * pool, * cue_pool;
 
-  if (ne_context_new(&ctx, io, NULL) != 0)
+  if (ctx->cue_index)
+    return 0;
+
+  /* Cues that precede the first Cluster were parsed with the headers. */
+  if (ctx->segment.cues.cue_point.head)
+    return ne_cue_index_build(ctx);
+
+  /* Otherwise check for a Cues element in the seek head and load it. */
+  found = ne_find_seek_for_id(ctx->segment.seek_head.head, ID_CUES);
+  if (!found)
     return -1;
 
-  r = ne_peek_element_with_io_limit(ctx, &id, max_offset);
-  if (r != 1) {
-    nestegg_destroy(ctx);
+  if (ne_get_uint(found->position, &seek_pos) != 0)
+    return -1;
+
+  /* Save old parser state. */
+  r = ne_ctx_save(ctx, &state);
+  if (r != 0)
+    return -1;
+
+  cue_pool = ne_pool_init(&ctx->alloc);
+  if (!cue_pool)
+    return -1;
+  pool = ctx->alloc_pool;
+  ctx->alloc_pool = cue_pool;
+
+  r = ne_load_cue_points(ctx, seek_pos, max_offset);
+  while (ctx->ancestor)
+    ne_ctx_pop(ctx);
+
+  ctx->alloc_pool = pool;
+
+  if (r >= 0)
+    r = ne_cue_index_build(ctx);
+
+  ctx->segment.cues.cue_point.head = NULL;
+  ctx->segment.cues.cue_point.tail = NULL;
+  ne_pool_destroy(cue_pool);
+
+  /* Reset parser state to original state and seek back to old position,
+     including when the Cues could not be loaded. */
+  if (ne_ctx_restore(ctx, &state) != 0)
+    return -1;
+
+  return r < 0 ? -1 : 0;
+}
+
+/* Read the CuePoint at offset, which must end by the end of the Cues,
+   without going through the parser.  Returns 1 on success, 0 if no well
+   formed CuePoint starts at offset, -1 on IO error. */
+static int
+ne_read_raw_cue_point(nestegg * ctx, int64_t offset, uint64_t track_number,
+                      struct ne_cue_entry * e)
+{
+  uint64_t id, size, length, value, pos_track, pos_cluster;
+  int64_t pos, child_end, inner_end;
+  int have_time = 0, have_track, have_cluster;
+
+  if (ne_io_seek(&ctx->io, offset, NESTEGG_SEEK_SET) != 0)
+    return -1;
+  if (ne_read_id(&ctx->io, &id, &length) != 1 || id != ID_CUE_POINT)
+    return 0;
+  if (ne_read_vint(&ctx->io, &size, &length) != 1)
     return 0;
+  pos = offset + 1 + length;
+  if (size > (uint64_t) (ctx->cues_end - pos))
+    return 0;
+  e->end = pos + size;
+  e->has_track = 0;
+
+  while (pos < e->end) {
+    if (ne_read_id(&ctx->io, &id, &length) != 1)
+      return 0;
+    pos += length;
+    if (ne_read_vint(&ctx->io, &size, &length) != 1)
+      return 0;
+    pos += length;
+    if (size > (uint64_t) (e->end - pos))
+      return 0;
+    child_end = pos + size;
+
+    if (id == ID_CUE_TIME) {
+      if (ne_read_uint(&ctx->io, &value, size) != 1)
+        return 0;
+      e->tstamp = ne_saturate_mul_uint64(value, ne_get_timecode_scale(ctx));
+      have_time = 1;
+    } else if (id == ID_CUE_TRACK_POSITIONS && !e->has_track) {
+      have_track = have_cluster = 0;
+      while (pos < child_end) {
+        if (ne_read_id(&ctx->io, &id, &length) != 1)
+          return 0;
+        pos += length;
+        if (ne_read_vint(&ctx->io, &size, &length) != 1)
+          return 0;
+        pos += length;
+        if (size > (uint64_t) (child_end - pos))
+          return 0;
+        inner_end = pos + size;
+        if (id == ID_CUE_TRACK) {
+          if (ne_read_uint(&ctx->io, &pos_track, size) != 1)
+            return 0;
+          have_track = 1;
+        } else if (id == ID_CUE_CLUSTER_POSITION) {
+          if (ne_read_uint(&ctx->io, &pos_cluster, size) != 1)
+            return 0;
+          have_cluster = 1;
+        }
+        pos = inner_end;
+        if (ne_io_seek(&ctx->io, pos, NESTEGG_SEEK_SET) != 0)
+          return -1;
+      }
+      if (have_track && have_cluster && pos_track == track_number) {
+        e->position = pos_cluster;
+        e->has_track = 1;
+      }
+    }
+
+    pos = child_end;
+    if (ne_io_seek(&ctx->io, pos, NESTEGG_SEEK_SET) != 0)
+      return -1;
   }
 
-  if (id != ID_EBML) {
-    nestegg_destroy(ctx);
-    return 0;
+  return have_time;
+}
+
+/* Find the first CuePoint listing track_number that starts at or after
+   offset, reading at most ctx->cue_window CuePoints.  The first CuePoint
+   is found by scanning for its ID and accepted only if another CuePoint
+   or the end of the Cues follows it.  Returns 1 and sets *start on
+   success, 0 if none was found, -1 on IO error. */
+static int
+ne_find_raw_cue_point(nestegg * ctx, int64_t offset, uint64_t track_number,
+                      int64_t * start, struct ne_cue_entry * e)
+{
+  unsigned char buf[CUE_WINDOW_SCAN_SIZE], * p;
+  struct ne_cue_entry next;
+  unsigned int i;
+  size_t n;
+  int r = 0;
+
+  while (offset < ctx->cues_end && r == 0) {
+    n = sizeof(buf);
+    if ((int64_t) n > ctx->cues_end - offset)
+      n = (size_t) (ctx->cues_end - offset);
+    if (ne_io_seek(&ctx->io, offset, NESTEGG_SEEK_SET) != 0 ||
+        ne_io_read(&ctx->io, buf, n) != 1)
+      return -1;
+
+    for (p = buf; r == 0 && (p = memchr(p, ID_CUE_POINT, n - (size_t) (p - buf))); ++p) {
+      *start = offset + (p - buf);
+      r = ne_read_raw_cue_point(ctx, *start, track_number, e);
+      if (r == 1 && e->end < ctx->cues_end) {
+        r = ne_read_raw_cue_point(ctx, e->end, track_number, &next);
+        if (r == 1 && next.tstamp < e->tstamp)
+          r = 0;
+      }
+      if (r < 0)
+        return -1;
+      if (r == 1)
+        break;
+    }
+    offset += n;
   }
+  if (r != 1)
+    return r;
 
-  if (ne_ctx_push(ctx, ne_top_level_elements, ctx) < 0) {
-    nestegg_destroy(ctx);
+  for (i = 1; !e->has_track; ++i) {
+    if (i >= ctx->cue_window || e->end >= ctx->cues_end)
+      return 0;
+    *start = e->end;
+    r = ne_read_raw_cue_point(ctx, *start, track_number, e);
+    if (r != 1)
+      return r;
+  }
+
+  return 1;
+}
+
+/* Find the Cluster position to seek to for track and tstamp without
+   loading the Cues.  The CuePoints are in time order, so the Cues element
+   is bisected for the last CuePoint listing track at or before tstamp,
+   reading at most ctx->cue_window CuePoints per step.  Returns 1 and sets
+   *position on success, 0 if no entry was found within those bounds, -1
+   on error.  The parser state is left for the caller to restore. */
+static int
+ne_cue_window_find(nestegg * ctx, unsigned int track, uint64_t tstamp, uint64_t * position)
+{
+  struct track_entry * entry;
+  struct ne_cue_entry e;
+  struct seek * found;
+  uint64_t track_number, seek_pos, id, size;
+  int64_t lo, hi, mid, start;
+  unsigned int i;
+  int r, have = 0;
+
+  entry = ne_find_track_entry(ctx, track);
+  if (!entry || ne_get_uint(entry->number, &track_number) != 0)
     return -1;
+  if (ne_get_timecode_scale(ctx) == 0)
+    return -1;
+
+  if (ctx->cues_start == 0) {
+    found = ne_find_seek_for_id(ctx->segment.seek_head.head, ID_CUES);
+    if (!found || ne_get_uint(found->position, &seek_pos) != 0)
+      return -1;
+    if (ne_io_seek(&ctx->io, ctx->segment_offset + seek_pos, NESTEGG_SEEK_SET) != 0)
+      return -1;
+    if (ne_read_id(&ctx->io, &id, NULL) != 1 || id != ID_CUES)
+      return -1;
+    if (ne_read_vint(&ctx->io, &size, NULL) != 1)
+      return -1;
+    start = ne_io_tell(&ctx->io);
+    if (start < 0 || size > (uint64_t) (INT64_MAX - start))
+      return -1;
+    ctx->cues_start = start;
+    ctx->cues_end = start + (int64_t) size;
   }
 
-  /* we don't check the return value of ne_parse, that might fail because
-     max_offset is not on a valid element end point. We only want to check
-     the EBML ID and that the doctype is equal to given doc type. */
-  ne_parse_with_io_limit(ctx, NULL, max_offset);
-  while (ctx->ancestor)
-    ne_ctx_pop(ctx);
+  /* The wanted CuePoint starts in [lo, hi). */
+  lo = ctx->cues_start;
+  hi = ctx->cues_end;
+  while (hi - lo > CUE_WINDOW_BISECT_SIZE) {
+    mid = lo + (hi - lo) / 2;
+    r = ne_find_raw_cue_point(ctx, mid, track_number, &start, &e);
+    if (r < 0)
+      return -1;
+    if (r == 1 && start < hi && e.tstamp <= tstamp)
+      lo = start;
+    else
+      hi = mid;
+  }
 
-  if (ne_get_string(ctx->ebml.doctype, &doctype) != 0 ||
-      strcmp(doctype, doc_type) != 0) {
-    nestegg_destroy(ctx);
+  /* Read every CuePoint starting in [lo, hi) for the last entry at or
+     before tstamp, or failing that, up to ctx->cue_window more for the
+     first entry if all are later. */
+  r = ne_find_raw_cue_point(ctx, lo, track_number, &start, &e);
+  for (i = 0; r == 1; ++i) {
+    if (e.has_track) {
+      if (have && e.tstamp > tstamp)
+        break;
+      *position = e.position;
+      have = 1;
+      if (e.tstamp > tstamp)
+        break;
+    } else if (start >= hi && i >= ctx->cue_window) {
+      break;
+    }
+    if (e.end >= ctx->cues_end)
+      break;
+    start = e.end;
+    r = ne_read_raw_cue_point(ctx, start, track_number, &e);
+  }
+  if (r < 0)
+    return -1;
+
+  return have;
+}
+
+/* Three functions that implement the nestegg_io interface, operating on a
+   io_buffer. */
+struct io_buffer {
+  unsigned char const * buffer;
+  size_t length;
+  int64_t offset;
+};
+
+static int64_t
+ne_buffer_read(void * buffer, size_t length, void * userdata)
+{
+  struct io_buffer * iob = userdata;
+  size_t available = iob->length - iob->offset;
+
+  if (available == 0)
     return 0;
+
+  if (available < length)
+    return -1;
+
+  memcpy(buffer, iob->buffer + iob->offset, length);
+  iob->offset += length;
+
+  return (int64_t) length;
+}
+
+static int
+ne_buffer_seek(int64_t offset, int whence, void * userdata)
+{
+  struct io_buffer * iob = userdata;
+  int64_t o = iob->offset;
+
+  switch(whence) {
+  case NESTEGG_SEEK_SET:
+    o = offset;
+    break;
+  case NESTEGG_SEEK_CUR:
+    o += offset;
+    break;
+  case NESTEGG_SEEK_END:
+    o = iob->length + offset;
+    break;
   }
 
-  nestegg_destroy(ctx);
+  if (o < 0 || o > (int64_t) iob->length)
+    return -1;
 
-  return 1;
+  iob->offset = o;
+  return 0;
 }
 
-static void
-ne_free_block_additions(struct block_additional * block_additional)
+static int64_t
+ne_buffer_tell(void * userdata)
 {
-  while (block_additional) {
-    struct block_additional * tmp = block_additional;
-    block_additional = block_additional->next;
-    free(tmp->data);
-    free(tmp);
+  struct io_buffer * iob = userdata;
+  return iob->offset;
+}
+
+static int
+ne_context_new(nestegg ** context, nestegg_io io, nestegg_log callback,
+               nestegg_init_options const * options)
+{
+  nestegg * ctx;
+  nestegg_init_options defaults;
+  nestegg_allocator a;
+
+  if (!(io.seek && io.tell && io.read))
+    return -1;
+
+  if (!options) {
+    nestegg_init_options_default(&defaults);
+    options = &defaults;
+  }
+
+  a = options->allocator;
+  if (!a.alloc && !a.realloc && !a.free) {
+    a.alloc = ne_default_alloc;
+    a.realloc = ne_default_realloc;
+    a.free = ne_default_free;
+  }
+  if (!(a.alloc && a.realloc && a.free))
+    return -1;
+
+  ctx = ne_alloc(&a, sizeof(*ctx));
+  if (!ctx)
+    return -1;
+  ctx->alloc = a;
+  ctx->io.alloc = &ctx->alloc;
+
+  ctx->io.io = ne_alloc(&ctx->alloc, sizeof(*ctx->io.io));
+  if (!ctx->io.io) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+  memcpy(ctx->io.io, &io, sizeof(io));
+
+  ctx->io.buf_size = IO_BUFFER_SIZE;
+  if (options->io_buffer_size != 0)
+    ctx->io.buf_size = options->io_buffer_size;
+  if (ctx->io.buf_size < IO_BUFFER_MIN_SIZE)
+    ctx->io.buf_size = IO_BUFFER_MIN_SIZE;
+  ctx->io.buf = ne_malloc(&ctx->alloc, ctx->io.buf_size);
+  if (!ctx->io.buf) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+  ctx->io.adaptive = options->io_buffer_adaptive;
+  ctx->io.buf_base_size = ctx->io.buf_size;
+  ctx->io.buf_target_size = ctx->io.buf_size > IO_BUFFER_MAX_SIZE ? ctx->io.buf_size : IO_BUFFER_MAX_SIZE;
+  ctx->io.fill_start = -1;
+  ctx->io.fill_end = -1;
+  ctx->io.pos = -1;
+  ctx->io.skip_threshold = options->skip_seek_threshold;
+  ctx->io.readv = options->io_readv;
+  ctx->cue_window = options->cue_window;
+
+  if (options->packet_pool_size != 0) {
+    ctx->packet_pool = ne_packet_pool_init(&ctx->alloc, options->packet_pool_size);
+    if (!ctx->packet_pool) {
+      nestegg_destroy(ctx);
+      return -1;
+    }
+  }
+
+  ctx->log = callback;
+  ctx->alloc_pool = ne_pool_init(&ctx->alloc);
+  if (!ctx->alloc_pool) {
+    nestegg_destroy(ctx);
+    return -1;
   }
+
+  if (!ctx->log)
+    ctx->log = ne_null_log_callback;
+
+  ne_dispatch_add_table(&ctx->dispatch, ne_top_level_elements);
+
+  *context = ctx;
+  return 0;
 }
 
-int
-nestegg_init(nestegg ** context, nestegg_io io, nestegg_log callback, int64_t max_offset)
+static int
+ne_match_doc_type(nestegg_io io, int64_t max_offset, const char* doc_type)
 {
   int r;
-  uint64_t id, version, docversion;
-  struct ebml_list_node * track;
+  uint64_t id;
   char * doctype;
   nestegg * ctx;
 
-  if (ne_context_new(&ctx, io, callback) != 0)
+  if (ne_context_new(&ctx, io, NULL, NULL) != 0)
     return -1;
 
   r = ne_peek_element_with_io_limit(ctx, &id, max_offset);
   if (r != 1) {
     nestegg_destroy(ctx);
-    return -1;
+    return 0;
   }
 
   if (id != ID_EBML) {
     nestegg_destroy(ctx);
-    return -1;
+    return 0;
   }
 
-  ctx->log(ctx, NESTEGG_LOG_DEBUG, "ctx %p", ctx);
-
   if (ne_ctx_push(ctx, ne_top_level_elements, ctx) < 0) {
     nestegg_destroy(ctx);
     return -1;
   }
 
-  r = ne_parse_with_io_limit(ctx, NULL, max_offset);
+  /* we don't check the return value of ne_parse, that might fail because
+     max_offset is not on a valid element end point. We only want to check
+     the EBML ID and that the doctype is equal to given doc type. */
+  ne_parse_with_io_limit(ctx, NULL, max_offset);
   while (ctx->ancestor)
     ne_ctx_pop(ctx);
 
-  if (r != 1) {
+  if (ne_get_string(ctx->ebml.doctype, &doctype) != 0 ||
+      strcmp(doctype, doc_type) != 0) {
     nestegg_destroy(ctx);
-    return -1;
+    return 0;
+  }
+
+  nestegg_destroy(ctx);
+
+  return 1;
+}
+
+static void
+ne_free_block_additions(nestegg_allocator const * a, struct block_additional * block_additional)
+{
+  while (block_additional) {
+    struct block_additional * tmp = block_additional;
+    block_additional = block_additional->next;
+    ne_free(a, tmp->data);
+    ne_free(a, tmp);
   }
+}
+
+/* Check the parsed headers and count the tracks. */
+static int
+ne_context_check_headers(nestegg * ctx)
+{
+  uint64_t version, docversion;
+  struct ebml_list_node * track;
+  char * doctype;
 
   if (ne_get_uint(ctx->ebml.ebml_read_version, &version) != 0)
     version = 1;
-  if (version != 1) {
-    nestegg_destroy(ctx);
+  if (version != 1)
     return -1;
-  }
 
   if (ne_get_string(ctx->ebml.doctype, &doctype) != 0)
     doctype = DOCTYPE_MKV;
-  if (!!strcmp(doctype, DOCTYPE_WEBM) && !!strcmp(doctype, DOCTYPE_MKV)) {
-    nestegg_destroy(ctx);
+  if (!!strcmp(doctype, DOCTYPE_WEBM) && !!strcmp(doctype, DOCTYPE_MKV))
     return -1;
-  }
 
   if (ne_get_uint(ctx->ebml.doctype_read_version, &docversion) != 0)
     docversion = 1;
-  if (docversion < 1 || docversion > 2) {
-    nestegg_destroy(ctx);
+  if (docversion < 1 || docversion > 2)
     return -1;
-  }
 
-  if (!ctx->segment.tracks.track_entry.head) {
-    nestegg_destroy(ctx);
+  if (!ctx->segment.tracks.track_entry.head)
     return -1;
-  }
 
   track = ctx->segment.tracks.track_entry.head;
   ctx->track_count = 0;
@@ -2577,25 +4088,257 @@ nestegg_init(nestegg ** context, nestegg_io io, nestegg_log callback, int64_t ma
     track = track->next;
   }
 
-  r = ne_ctx_save(ctx, &ctx->saved);
-  if (r != 0) {
-    nestegg_destroy(ctx);
-    return -1;
-  }
+  return 0;
+}
+
+/* Parse everything up to the first Cluster and validate the headers. */
+static int
+ne_context_parse_headers(nestegg * ctx, int64_t max_offset)
+{
+  int r;
+  uint64_t id;
+
+  r = ne_peek_element_with_io_limit(ctx, &id, max_offset);
+  if (r != 1)
+    return -1;
+
+  if (id != ID_EBML)
+    return -1;
+
+  ctx->log(ctx, NESTEGG_LOG_DEBUG, "ctx %p", ctx);
+
+  if (ne_ctx_push(ctx, ne_top_level_elements, ctx) < 0)
+    return -1;
+
+  r = ne_parse_with_io_limit(ctx, NULL, max_offset);
+  while (ctx->ancestor)
+    ne_ctx_pop(ctx);
+
+  if (r != 1)
+    return -1;
+
+  if (ne_context_check_headers(ctx) != 0)
+    return -1;
+
+  r = ne_ctx_save(ctx, &ctx->saved);
+  if (r != 0)
+    return -1;
+  ctx->first_cluster = ctx->saved;
+
+  return 0;
+}
+
+static int
+ne_context_init(nestegg ** context, nestegg * ctx, int64_t max_offset)
+{
+  if (ne_context_parse_headers(ctx, max_offset) != 0) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
 
   *context = ctx;
 
   return 0;
 }
 
+void
+nestegg_init_options_default(nestegg_init_options * options)
+{
+  memset(options, 0, sizeof(*options));
+  options->io_buffer_size = IO_BUFFER_SIZE;
+  options->io_buffer_adaptive = 0;
+  options->skip_seek_threshold = IO_SKIP_SEEK_THRESHOLD;
+  options->io_readv = NULL;
+  options->packet_pool_size = 0;
+  options->cue_window = 0;
+  options->mmap_window_size = 0;
+  options->allocator.alloc = NULL;
+  options->allocator.realloc = NULL;
+  options->allocator.free = NULL;
+  options->allocator.userdata = NULL;
+}
+
+int
+nestegg_init(nestegg ** context, nestegg_io io, nestegg_log callback, int64_t max_offset)
+{
+  return nestegg_init_with_options(context, io, callback, max_offset, NULL);
+}
+
+int
+nestegg_init_with_options(nestegg ** context, nestegg_io io, nestegg_log callback,
+                          int64_t max_offset, nestegg_init_options const * options)
+{
+  nestegg * ctx;
+
+  if (ne_context_new(&ctx, io, callback, options) != 0)
+    return -1;
+
+  return ne_context_init(context, ctx, max_offset);
+}
+
+int
+nestegg_init_memory(nestegg ** context, unsigned char const * buffer, size_t length,
+                    nestegg_log callback, int64_t max_offset)
+{
+  nestegg * ctx;
+  nestegg_io io;
+
+  if (!buffer)
+    return -1;
+
+  /* The callbacks are never invoked for a memory-backed stream; they are
+     supplied only to satisfy ne_context_new. */
+  io.read = ne_buffer_read;
+  io.seek = ne_buffer_seek;
+  io.tell = ne_buffer_tell;
+  io.userdata = NULL;
+
+  if (ne_context_new(&ctx, io, callback, NULL) != 0)
+    return -1;
+
+  ctx->io.mem = buffer;
+  ctx->io.mem_length = length;
+  ctx->io.mem_size = (int64_t) length;
+
+  return ne_context_init(context, ctx, max_offset);
+}
+
+int
+nestegg_init_mmap(nestegg ** context, char const * path, nestegg_log callback,
+                  int64_t max_offset)
+{
+  return nestegg_init_mmap_with_options(context, path, callback, max_offset, NULL);
+}
+
+int
+nestegg_init_mmap_with_options(nestegg ** context, char const * path, nestegg_log callback,
+                               int64_t max_offset, nestegg_init_options const * options)
+{
+#if defined(NE_HAVE_MMAP)
+  nestegg * ctx;
+  nestegg_io io;
+  struct stat st;
+  long page_size;
+  size_t window;
+  void * addr;
+
+  if (!path)
+    return -1;
+
+  io.read = ne_buffer_read;
+  io.seek = ne_buffer_seek;
+  io.tell = ne_buffer_tell;
+  io.userdata = NULL;
+
+  if (ne_context_new(&ctx, io, callback, options) != 0)
+    return -1;
+
+  ctx->io.mapping = ne_alloc(&ctx->alloc, sizeof(*ctx->io.mapping));
+  if (!ctx->io.mapping) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+
+  ctx->io.mapping->fd = open(path, O_RDONLY);
+  if (ctx->io.mapping->fd < 0) {
+    ne_free(&ctx->alloc, ctx->io.mapping);
+    ctx->io.mapping = NULL;
+    nestegg_destroy(ctx);
+    return -1;
+  }
+
+  page_size = sysconf(_SC_PAGESIZE);
+  ctx->io.mapping->granularity = page_size > 0 ? (size_t) page_size : 4096;
+
+  /* Windows are whole multiples of the granularity, so that the window
+     mapped for any position contains it. */
+  window = options && options->mmap_window_size != 0 ? options->mmap_window_size :
+    MMAP_WINDOW_SIZE;
+  if (window > (size_t) -1 - ctx->io.mapping->granularity)
+    window = MMAP_WINDOW_SIZE;
+  window += ctx->io.mapping->granularity - 1;
+  ctx->io.mapping->window = window - window % ctx->io.mapping->granularity;
+
+  if (fstat(ctx->io.mapping->fd, &st) != 0 || st.st_size <= 0) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+  ctx->io.mem_size = st.st_size;
+
+  /* Map the whole file when the address space allows it so that packet
+     views remain valid; otherwise, or if a window size was requested,
+     fall back to a moving window. */
+  addr = MAP_FAILED;
+  if ((uint64_t) st.st_size <= (uint64_t) (size_t) -1 &&
+      !(options && options->mmap_window_size != 0))
+    addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                ctx->io.mapping->fd, 0);
+  if (addr != MAP_FAILED) {
+    ctx->io.mem = addr;
+    ctx->io.mem_length = (size_t) st.st_size;
+  } else if (ne_io_mem_remap(&ctx->io, 0) != 0) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+
+  return ne_context_init(context, ctx, max_offset);
+#else
+  return -1;
+#endif
+}
+
+int
+nestegg_init_push(nestegg ** context, nestegg_log callback)
+{
+  nestegg * ctx;
+  nestegg_io io;
+
+  /* The callbacks are never invoked for a memory-backed stream; they are
+     supplied only to satisfy ne_context_new. */
+  io.read = ne_buffer_read;
+  io.seek = ne_buffer_seek;
+  io.tell = ne_buffer_tell;
+  io.userdata = NULL;
+
+  if (ne_context_new(&ctx, io, callback, NULL) != 0)
+    return -1;
+
+  ctx->io.push = ne_alloc(&ctx->alloc, sizeof(*ctx->io.push));
+  if (!ctx->io.push) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+  ctx->io.push->capacity = IO_BUFFER_SIZE;
+  ctx->io.push->buf = ne_malloc(&ctx->alloc, ctx->io.push->capacity);
+  if (!ctx->io.push->buf) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+  ctx->io.mem = ctx->io.push->buf;
+
+  *context = ctx;
+  return 0;
+}
+
 void
 nestegg_destroy(nestegg * ctx)
 {
+  nestegg_allocator a = ctx->alloc;
+
   assert(ctx->ancestor == NULL);
   if (ctx->alloc_pool)
     ne_pool_destroy(ctx->alloc_pool);
-  free(ctx->io.io);
-  free(ctx);
+  if (ctx->packet_pool) {
+    /* Packets still outstanding keep the pool alive but are no longer
+       recycled. */
+    ctx->packet_pool->limit = 0;
+    ne_packet_pool_trim(ctx->packet_pool);
+    ne_packet_pool_release(ctx->packet_pool);
+  }
+  ne_io_mem_close(&ctx->io);
+  ne_free(&a, ctx->io.buf);
+  ne_free(&a, ctx->io.io);
+  ne_free(&a, ctx);
 }
 
 int
@@ -2636,18 +4379,27 @@ nestegg_track_count(nestegg * ctx, unsigned int * tracks)
   return 0;
 }
 
+/* The offset of the last byte of the last Cluster found by
+   nestegg_build_index, or -1 if the Clusters are not known. */
+static int64_t
+ne_cluster_index_end(nestegg * ctx)
+{
+  struct ne_cluster_index const * clusters = ctx->cluster_index;
+  uint64_t end;
+
+  if (!clusters || clusters->count == 0)
+    return -1;
+  end = clusters->positions[clusters->count - 1] + clusters->sizes[clusters->count - 1];
+  if (end == 0 || end > (uint64_t) (INT64_MAX - ctx->segment_offset))
+    return -1;
+  return ctx->segment_offset + (int64_t) end - 1;
+}
+
 int
 nestegg_get_cue_point(nestegg * ctx, unsigned int cluster_num, int64_t max_offset,
                       int64_t * start_pos, int64_t * end_pos, uint64_t * tstamp)
 {
-  int range_obtained = 0;
-  unsigned int cluster_count = 0;
-  struct cue_point * cue_point;
-  struct cue_track_positions * pos;
-  uint64_t seek_pos, track_number, tc_scale, time;
-  struct ebml_list_node * cues_node = ctx->segment.cues.cue_point.head;
-  struct ebml_list_node * cue_pos_node = NULL;
-  unsigned int track = 0, track_count = 0, track_index;
+  struct ne_cue_index * index;
 
   if (!start_pos || !end_pos || !tstamp)
     return -1;
@@ -2657,113 +4409,116 @@ nestegg_get_cue_point(nestegg * ctx, unsigned int cluster_num, int64_t max_offse
   *end_pos = -1;
   *tstamp = 0;
 
-  if (!cues_node) {
-    ne_init_cue_points(ctx, max_offset);
-    cues_node = ctx->segment.cues.cue_point.head;
-    /* Verify cues have been added to context. */
-    if (!cues_node)
-      return -1;
-  }
-
-  nestegg_track_count(ctx, &track_count);
-
-  tc_scale = ne_get_timecode_scale(ctx);
-  if (tc_scale == 0)
+  if (ne_init_cue_points(ctx, max_offset) != 0)
     return -1;
+  index = ctx->cue_index;
 
-  while (cues_node && !range_obtained) {
-    assert(cues_node->id == ID_CUE_POINT);
-    cue_point = cues_node->data;
-    cue_pos_node = cue_point->cue_track_positions.head;
-    while (cue_pos_node) {
-      assert(cue_pos_node->id == ID_CUE_TRACK_POSITIONS);
-      pos = cue_pos_node->data;
-      for (track = 0; track < track_count; ++track) {
-        if (ne_get_uint(pos->track, &track_number) != 0)
-          return -1;
+  if (cluster_num < index->count) {
+    *start_pos = ctx->segment_offset + index->positions[cluster_num];
+    *tstamp = index->tstamps[cluster_num];
+  }
+  if (cluster_num < index->count - 1)
+    *end_pos = ctx->segment_offset + index->positions[cluster_num + 1] - 1;
+  else if (cluster_num < index->count)
+    *end_pos = ne_cluster_index_end(ctx);
 
-        if (ne_map_track_number_to_index(ctx, track_number, &track_index) != 0)
-          return -1;
+  return 0;
+}
 
-        if (track_index == track) {
-          if (ne_get_uint(pos->cluster_position, &seek_pos) != 0)
-            return -1;
-          if (cluster_count == cluster_num) {
-            *start_pos = ctx->segment_offset + seek_pos;
-            if (ne_get_uint(cue_point->time, &time) != 0)
-              return -1;
-            *tstamp = time * tc_scale;
-          } else if (cluster_count == cluster_num + 1) {
-            *end_pos = ctx->segment_offset + seek_pos - 1;
-            range_obtained = 1;
-            break;
-          }
-          cluster_count++;
-        }
-      }
-      cue_pos_node = cue_pos_node->next;
+/* Fill point with entry n of the time ordered cue entries of track. */
+static void
+ne_cue_index_point(nestegg * ctx, unsigned int track, unsigned int n,
+                   nestegg_cue_point * point)
+{
+  struct ne_cue_index const * index = ctx->cue_index;
+  unsigned int const * entries = index->by_track + index->track_first[track];
+  unsigned int count = index->track_first[track + 1] - index->track_first[track];
+
+  assert(n < count);
+  point->start_pos = ctx->segment_offset + index->positions[entries[n]];
+  point->tstamp = index->tstamps[entries[n]];
+  point->end_pos = ne_cluster_index_end(ctx);
+  /* Several cue points may share a Cluster; it ends where the next one in
+     time order starts. */
+  while (++n < count) {
+    if (index->positions[entries[n]] > index->positions[entries[n - 1]]) {
+      point->end_pos = ctx->segment_offset + index->positions[entries[n]] - 1;
+      break;
     }
-    cues_node = cues_node->next;
   }
-
-  return 0;
 }
 
 int
-nestegg_offset_seek(nestegg * ctx, uint64_t offset)
+nestegg_get_cue_points(nestegg * ctx, unsigned int track, int64_t max_offset,
+                       nestegg_cue_point * points, unsigned int * count)
 {
-  int r;
+  struct ne_cue_index const * index;
+  unsigned int const * entries;
+  unsigned int i, total;
+  int64_t end_pos;
 
-  if (offset > INT64_MAX)
+  if (!count || (*count > 0 && !points))
     return -1;
 
-  /* Seek and set up parser state for segment-level element (Cluster). */
-  r = ne_io_seek(&ctx->io, offset, NESTEGG_SEEK_SET);
-  if (r != 0)
+  if (track >= ctx->track_count || ne_init_cue_points(ctx, max_offset) != 0) {
+    *count = 0;
     return -1;
-  ctx->last_valid = 0;
+  }
 
-  assert(ctx->ancestor == NULL);
+  index = ctx->cue_index;
+  entries = index->by_track + index->track_first[track];
+  total = index->track_first[track + 1] - index->track_first[track];
+  end_pos = ne_cluster_index_end(ctx);
+
+  /* Walk backwards so each end is known from the following entries in a
+     single pass. */
+  for (i = total; i-- > 0;) {
+    int64_t start_pos = ctx->segment_offset + index->positions[entries[i]];
+    if (i < *count) {
+      points[i].start_pos = start_pos;
+      points[i].end_pos = end_pos;
+      points[i].tstamp = index->tstamps[entries[i]];
+    }
+    if (i > 0 && index->positions[entries[i - 1]] < index->positions[entries[i]])
+      end_pos = start_pos - 1;
+  }
+  *count = total;
 
   return 0;
 }
 
 int
-nestegg_track_seek(nestegg * ctx, unsigned int track, uint64_t tstamp)
+nestegg_get_track_cue_point(nestegg * ctx, unsigned int track, unsigned int n,
+                            int64_t max_offset, nestegg_cue_point * point)
 {
-  int r;
-  struct cue_point * cue_point;
-  struct cue_track_positions * pos;
-  uint64_t seek_pos, tc_scale;
-
-  /* If there are no cues loaded, check for cues element in the seek head
-     and load it. */
-  if (!ctx->segment.cues.cue_point.head) {
-    r = ne_init_cue_points(ctx, -1);
-    if (r != 0)
-      return -1;
-  }
-
-  tc_scale = ne_get_timecode_scale(ctx);
-  if (tc_scale == 0)
+  if (!point)
     return -1;
 
-  cue_point = ne_find_cue_point_for_tstamp(ctx, ctx->segment.cues.cue_point.head,
-                                           track, tc_scale, tstamp);
-  if (!cue_point)
+  if (track >= ctx->track_count || ne_init_cue_points(ctx, max_offset) != 0)
     return -1;
 
-  pos = ne_find_cue_position_for_track(ctx, cue_point->cue_track_positions.head, track);
-  if (pos == NULL)
+  if (n >= ctx->cue_index->track_first[track + 1] - ctx->cue_index->track_first[track])
     return -1;
 
-  if (ne_get_uint(pos->cluster_position, &seek_pos) != 0)
+  ne_cue_index_point(ctx, track, n, point);
+  return 0;
+}
+
+int
+nestegg_offset_seek(nestegg * ctx, uint64_t offset)
+{
+  int r;
+
+  if (offset > INT64_MAX)
     return -1;
 
-  /* Seek to (we assume) the start of a Cluster element. */
-  r = nestegg_offset_seek(ctx, ctx->segment_offset + seek_pos);
+  /* Seek and set up parser state for segment-level element (Cluster). */
+  r = ne_io_seek(&ctx->io, offset, NESTEGG_SEEK_SET);
   if (r != 0)
     return -1;
+  ctx->last_valid = 0;
+
+  assert(ctx->ancestor == NULL);
 
   return 0;
 }
@@ -2928,21 +4683,12 @@ nestegg_track_codec_data(nestegg * ctx, unsigned int track, unsigned int item,
     unsigned int i;
     int r;
 
-    nestegg_io buf_io;
     ne_io buf_io_ctx;
-    struct io_buffer userdata;
-    userdata.buffer = codec_private.data;
-    userdata.length = codec_private.length;
-    userdata.offset = 0;
-
-    buf_io.read = ne_buffer_read;
-    buf_io.seek = ne_buffer_seek;
-    buf_io.tell = ne_buffer_tell;
-    buf_io.userdata = &userdata;
 
     memset(&buf_io_ctx, 0, sizeof(buf_io_ctx));
-    buf_io_ctx.io = &buf_io;
-    buf_io_ctx.max_offset = codec_private.length;
+    buf_io_ctx.mem = codec_private.data;
+    buf_io_ctx.mem_length = codec_private.length;
+    buf_io_ctx.mem_size = codec_private.length;
 
     total = 0;
 
@@ -3287,8 +5033,8 @@ nestegg_read_reset(nestegg * ctx)
   return ne_ctx_restore(ctx, &ctx->saved);
 }
 
-int
-nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
+static int
+ne_read_packet(nestegg * ctx, nestegg_packet ** pkt, struct ne_packet_dest const * dest)
 {
   int r, read_block = 0;
   uint64_t id, size;
@@ -3309,6 +5055,8 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
 
     switch (id) {
     case ID_CLUSTER: {
+      if (!ne_size_is_unknown(size))
+        ne_io_size_hint(&ctx->io, size);
       for (;;) {
         r = ne_read_element(ctx, &id, &size);
         if (r != 1)
@@ -3333,7 +5081,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
       break;
     }
     case ID_SIMPLE_BLOCK:
-      r = ne_read_block(ctx, id, size, pkt);
+      r = ne_read_block(ctx, id, size, dest, pkt);
       if (r != 1)
         return r;
       (*pkt)->end_offset = ne_io_tell(&ctx->io);
@@ -3365,7 +5113,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
       while (1) {
         int64_t pos = ne_io_tell(&ctx->io);
         if (pos < 0) {
-          ne_free_block_additions(block_additional);
+          ne_free_block_additions(&ctx->alloc, block_additional);
           if (*pkt) {
             nestegg_free_packet(*pkt);
             *pkt = NULL;
@@ -3376,7 +5124,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
           break;
         r = ne_read_element(ctx, &id, &size);
         if (r != 1) {
-          ne_free_block_additions(block_additional);
+          ne_free_block_additions(&ctx->alloc, block_additional);
           if (*pkt) {
             nestegg_free_packet(*pkt);
             *pkt = NULL;
@@ -3391,9 +5139,9 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
                      "read_packet: multiple Blocks in BlockGroup, dropping previously read Block");
             nestegg_free_packet(*pkt);
           }
-          r = ne_read_block(ctx, id, size, pkt);
+          r = ne_read_block(ctx, id, size, dest, pkt);
           if (r != 1) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3407,7 +5155,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
         case ID_BLOCK_DURATION: {
           r = ne_read_uint(&ctx->io, &block_duration, size);
           if (r != 1) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3416,7 +5164,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
           }
           tc_scale = ne_get_timecode_scale(ctx);
           if (tc_scale == 0) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3430,7 +5178,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
         case ID_DISCARD_PADDING: {
           r = ne_read_int(&ctx->io, &discard_padding, size);
           if (r != 1) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3443,7 +5191,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
         case ID_BLOCK_ADDITIONS: {
           /* There should only be one BlockAdditions; treat multiple as an error. */
           if (block_additional) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3452,7 +5200,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
           }
           r = ne_read_block_additions(ctx, size, &block_additional);
           if (r != 1) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3464,7 +5212,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
         case ID_REFERENCE_BLOCK: {
           r = ne_read_int(&ctx->io, &reference_block, size);
           if (r != 1) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3481,7 +5229,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
                      "read_packet: unknown element %llx in BlockGroup", id);
           r = ne_io_read_skip(&ctx->io, size);
           if (r != 1) {
-            ne_free_block_additions(block_additional);
+            ne_free_block_additions(&ctx->alloc, block_additional);
             if (*pkt) {
               nestegg_free_packet(*pkt);
               *pkt = NULL;
@@ -3495,7 +5243,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
       if (*pkt) {
         (*pkt)->end_offset = ne_io_tell(&ctx->io);
         if ((*pkt)->end_offset < 0) {
-          ne_free_block_additions(block_additional);
+          ne_free_block_additions(&ctx->alloc, block_additional);
           nestegg_free_packet(*pkt);
           *pkt = NULL;
           return -1;
@@ -3512,7 +5260,7 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
              predictive frames and no keyframes */
           (*pkt)->keyframe = NESTEGG_PACKET_HAS_KEYFRAME_FALSE;
       } else {
-        ne_free_block_additions(block_additional);
+        ne_free_block_additions(&ctx->alloc, block_additional);
       }
       break;
     }
@@ -3528,45 +5276,253 @@ nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
 }
 
 int
-nestegg_read_last_packet(nestegg * context, unsigned int track,
-                         nestegg_packet ** packet)
+nestegg_read_packet(nestegg * ctx, nestegg_packet ** pkt)
 {
-  struct saved_state saved;
-  uint64_t max_end_ns = 0;
-  nestegg_packet * last_packet = NULL;
+  struct ne_packet_dest dest = { 0, NULL, 0 };
 
-  if (!context || !packet) {
+  return ne_read_packet(ctx, pkt, &dest);
+}
+
+int
+nestegg_read_packet_view(nestegg * ctx, nestegg_packet ** pkt)
+{
+  struct ne_packet_dest dest = { 1, NULL, 0 };
+
+  return ne_read_packet(ctx, pkt, &dest);
+}
+
+int
+nestegg_read_packet_into(nestegg * ctx, unsigned char * buffer, size_t capacity,
+                         nestegg_packet ** pkt)
+{
+  struct ne_packet_dest dest;
+
+  *pkt = NULL;
+  if (!buffer)
     return -1;
-  }
 
-  *packet = NULL;
+  dest.view = 0;
+  dest.buf = buffer;
+  dest.capacity = capacity;
 
-  /* Save and restore the parser state later. */
-  if (ne_ctx_save(context, &saved) != 0)
+  return ne_read_packet(ctx, pkt, &dest);
+}
+
+int
+nestegg_peek_packet_size(nestegg * ctx, size_t * size)
+{
+  struct saved_state saved;
+  uint64_t id, block_size = 0;
+  int64_t block_group_end;
+  int r, found = 0;
+
+  assert(ctx->ancestor == NULL);
+
+  *size = 0;
+
+  if (ne_ctx_save(ctx, &saved) != 0)
     return -1;
 
-  for (;;) {
-    nestegg_packet * pkt = NULL;
-    unsigned int pkt_track = 0;
-    int r = nestegg_read_packet(context, &pkt);
-    if (r == 0) {
-      /* EOS */
+  /* Walk the element headers the way ne_read_packet does, entering
+     Clusters and BlockGroups, until the next block.  The size of the
+     block bounds the payload bytes of the packet. */
+  while (!found) {
+    r = ne_read_element(ctx, &id, &block_size);
+    if (r != 1)
       break;
-    }
-    if (r < 0) {
-      if (pkt) {
-        nestegg_free_packet(pkt);
-      }
-      if (last_packet) {
-        nestegg_free_packet(last_packet);
-        last_packet = NULL;
-      }
-      if (ne_ctx_restore(context, &saved) != 0)
-        return -1;
-      return -1;
-    }
 
-    if (nestegg_packet_track(pkt, &pkt_track) == 0 && pkt_track == track) {
+    switch (id) {
+    case ID_CLUSTER:
+      break;
+    case ID_SIMPLE_BLOCK:
+      found = 1;
+      break;
+    case ID_BLOCK_GROUP:
+      block_group_end = ne_io_tell(&ctx->io);
+      if (block_group_end < 0) {
+        r = -1;
+        break;
+      }
+      block_group_end += block_size;
+      while (ne_io_tell(&ctx->io) < block_group_end) {
+        r = ne_read_element(ctx, &id, &block_size);
+        if (r != 1)
+          break;
+        if (id == ID_BLOCK) {
+          found = 1;
+          break;
+        }
+        r = ne_io_read_skip(&ctx->io, block_size);
+        if (r != 1)
+          break;
+      }
+      if (!found && r == 1)
+        r = -1;
+      break;
+    default:
+      r = ne_io_read_skip(&ctx->io, block_size);
+      break;
+    }
+    if (r != 1)
+      break;
+  }
+
+  if (ne_ctx_restore(ctx, &saved) != 0)
+    return -1;
+
+  if (!found)
+    return r == 0 ? 0 : -1;
+
+  if (block_size > LIMIT_BLOCK)
+    return -1;
+  *size = (size_t) block_size;
+
+  return 1;
+}
+
+/* Check whether a pushed stream holds everything the next parse step will
+   read: the headers up to the first Cluster, or the elements up to and
+   including the next block.  Only element headers are examined and the
+   scan resumes where it last stopped, so payloads are not parsed until
+   they are complete.  Returns 1 if the step can run and 0 if more data is
+   needed. */
+static int
+ne_push_scan(nestegg * ctx)
+{
+  ne_io * io = &ctx->io;
+  struct ne_push * p = io->push;
+
+  if (io->mem_size < p->need)
+    return 0;
+
+  for (;;) {
+    unsigned char const * data = io->mem + (p->scan_pos - io->mem_base);
+    size_t avail = (size_t) (io->mem_size - p->scan_pos);
+    uint64_t id, size, id_length, size_length;
+    int64_t start, end;
+
+    if (ne_decode_vint(data, avail, &id, &id_length, MASK_NONE) != 1 ||
+        ne_decode_vint(data + id_length, avail - id_length,
+                       &size, &size_length, MASK_FIRST_BIT) != 1) {
+      p->need = io->mem_size + 1;
+      return 0;
+    }
+
+    /* Header parsing suspends on peeking the first Cluster. */
+    if (!p->headers && id == ID_CLUSTER)
+      return 1;
+
+    start = p->scan_pos + (int64_t) (id_length + size_length);
+    if (id == ID_SEGMENT || id == ID_CLUSTER) {
+      p->scan_pos = start;
+      continue;
+    }
+
+    /* As in the parser, an all-ones size is only special for masters. */
+    if (size > (uint64_t) (INT64_MAX - start))
+      return -1;
+    end = start + (int64_t) size;
+    if (end > io->mem_size) {
+      p->need = end;
+      return 0;
+    }
+    p->scan_pos = end;
+
+    if (p->headers && (id == ID_SIMPLE_BLOCK || id == ID_BLOCK_GROUP))
+      return 1;
+  }
+}
+
+int
+nestegg_feed(nestegg * ctx, unsigned char const * data, size_t length,
+             nestegg_packet ** pkt)
+{
+  struct ne_push * p = ctx->io.push;
+  struct ne_packet_dest dest = { 0, NULL, 0 };
+  int64_t pos;
+  int r;
+
+  *pkt = NULL;
+
+  if (!p || (length > 0 && !data))
+    return -1;
+
+  if (length > 0) {
+    pos = ctx->io.mem_pos < p->scan_pos ? ctx->io.mem_pos : p->scan_pos;
+    if (ne_io_push_append(&ctx->io, pos, data, length) != 0)
+      return -1;
+  }
+
+  r = ne_push_scan(ctx);
+  if (r != 1)
+    return r;
+
+  if (!p->headers) {
+    if (ne_context_parse_headers(ctx, -1) != 0)
+      return -1;
+    p->headers = 1;
+    return NESTEGG_FEED_HEADERS;
+  }
+
+  r = ne_read_packet(ctx, pkt, &dest);
+  if (r == 0) {
+    /* The scan and the parser disagree on where the block ends; wait for
+       more data and parse the packet again. */
+    if (ne_ctx_restore(ctx, &ctx->saved) != 0)
+      return -1;
+    p->need = ctx->io.mem_size + 1;
+    return NESTEGG_FEED_NEED_MORE_DATA;
+  }
+  if (r != 1)
+    return -1;
+
+  pos = ne_io_tell(&ctx->io);
+  if (pos > p->scan_pos)
+    p->scan_pos = pos;
+
+  return NESTEGG_FEED_PACKET;
+}
+
+int
+nestegg_read_last_packet(nestegg * context, unsigned int track,
+                         nestegg_packet ** packet)
+{
+  struct saved_state saved;
+  uint64_t max_end_ns = 0;
+  nestegg_packet * last_packet = NULL;
+
+  if (!context || !packet) {
+    return -1;
+  }
+
+  *packet = NULL;
+
+  /* Save and restore the parser state later. */
+  if (ne_ctx_save(context, &saved) != 0)
+    return -1;
+
+  for (;;) {
+    nestegg_packet * pkt = NULL;
+    unsigned int pkt_track = 0;
+    int r = nestegg_read_packet(context, &pkt);
+    if (r == 0) {
+      /* EOS */
+      break;
+    }
+    if (r < 0) {
+      if (pkt) {
+        nestegg_free_packet(pkt);
+      }
+      if (last_packet) {
+        nestegg_free_packet(last_packet);
+        last_packet = NULL;
+      }
+      if (ne_ctx_restore(context, &saved) != 0)
+        return -1;
+      return -1;
+    }
+
+    if (nestegg_packet_track(pkt, &pkt_track) == 0 && pkt_track == track) {
       /* Calculate the end timestamp of this packet */
       uint64_t ts = 0;
       uint64_t dur = 0;
@@ -3607,18 +5563,30 @@ nestegg_read_last_packet(nestegg * context, unsigned int track,
 void
 nestegg_free_packet(nestegg_packet * pkt)
 {
-  struct frame * frame;
+  struct ne_packet_pool * pool = pkt->pool;
 
-  while (pkt->frame) {
-    frame = pkt->frame;
-    pkt->frame = frame->next;
+  if (pkt->frames != pkt->frame_storage)
+    ne_free_payload(&pkt->alloc, pool, pkt->frames);
+  ne_free_payload(&pkt->alloc, pool, pkt->payload);
+  if (pkt->encryption)
+    ne_free_frame_encryption(&pkt->alloc, pool, pkt->encryption);
 
-    ne_free_frame(frame);
-  }
+  ne_free_block_additions(&pkt->alloc, pkt->block_additional);
 
-  ne_free_block_additions(pkt->block_additional);
+  if (!pool) {
+    nestegg_allocator a = pkt->alloc;
+
+    ne_free(&a, pkt);
+    return;
+  }
 
-  free(pkt);
+  if (ne_packet_pool_keep(pool, sizeof(*pkt))) {
+    pkt->next = pool->packets;
+    pool->packets = pkt;
+  } else {
+    ne_free(&pool->alloc, pkt);
+  }
+  ne_packet_pool_release(pool);
 }
 
 int
@@ -3678,15 +5646,7 @@ nestegg_packet_end_offset(nestegg_packet * pkt, int64_t * end_offset)
 int
 nestegg_packet_count(nestegg_packet * pkt, unsigned int * count)
 {
-  struct frame * f = pkt->frame;
-
-  *count = 0;
-
-  while (f) {
-    *count += 1;
-    f = f->next;
-  }
-
+  *count = pkt->frame_count;
   return 0;
 }
 
@@ -3694,23 +5654,24 @@ int
 nestegg_packet_data(nestegg_packet * pkt, unsigned int item,
                     unsigned char ** data, size_t * length)
 {
-  struct frame * f = pkt->frame;
-  unsigned int count = 0;
-
   *data = NULL;
   *length = 0;
 
-  while (f) {
-    if (count == item) {
-      *data = f->data;
-      *length = f->length;
-      return 0;
-    }
-    count += 1;
-    f = f->next;
-  }
+  if (item >= pkt->frame_count)
+    return -1;
 
-  return -1;
+  *data = pkt->frames[item].data;
+  *length = pkt->frames[item].length;
+  return 0;
+}
+
+int
+nestegg_packet_chunks(nestegg_packet * pkt, nestegg_packet_chunk const ** chunks,
+                      unsigned int * count)
+{
+  *chunks = pkt->frames;
+  *count = pkt->frame_count;
+  return 0;
 }
 
 int
@@ -3737,18 +5698,18 @@ nestegg_packet_additional_data(nestegg_packet * pkt, unsigned int id,
 int
 nestegg_packet_encryption(nestegg_packet * pkt)
 {
-  struct frame * f = pkt->frame;
+  struct frame_encryption * e = pkt->encryption;
   unsigned char encrypted_bit;
   unsigned char partitioned_bit;
 
-  if (!f->frame_encryption)
+  if (!e)
     return NESTEGG_PACKET_HAS_SIGNAL_BYTE_FALSE;
 
   /* Should never have parsed blocks with both encryption and lacing */
-  assert(f->next == NULL);
+  assert(pkt->frame_count == 1);
 
-  encrypted_bit = f->frame_encryption->signal_byte & ENCRYPTED_BIT_MASK;
-  partitioned_bit = f->frame_encryption->signal_byte & PARTITIONED_BIT_MASK;
+  encrypted_bit = e->signal_byte & ENCRYPTED_BIT_MASK;
+  partitioned_bit = e->signal_byte & PARTITIONED_BIT_MASK;
 
   if (encrypted_bit != PACKET_ENCRYPTED)
     return NESTEGG_PACKET_HAS_SIGNAL_BYTE_UNENCRYPTED;
@@ -3762,24 +5723,24 @@ nestegg_packet_encryption(nestegg_packet * pkt)
 int
 nestegg_packet_iv(nestegg_packet * pkt, unsigned char const ** iv, size_t * length)
 {
-  struct frame * f = pkt->frame;
+  struct frame_encryption * e = pkt->encryption;
   unsigned char encrypted_bit;
 
   *iv = NULL;
   *length = 0;
-  if (!f->frame_encryption)
+  if (!e)
     return -1;
 
   /* Should never have parsed blocks with both encryption and lacing */
-  assert(f->next == NULL);
+  assert(pkt->frame_count == 1);
 
-  encrypted_bit = f->frame_encryption->signal_byte & ENCRYPTED_BIT_MASK;
+  encrypted_bit = e->signal_byte & ENCRYPTED_BIT_MASK;
 
   if (encrypted_bit != PACKET_ENCRYPTED)
     return 0;
 
-  *iv = f->frame_encryption->iv;
-  *length = f->frame_encryption->length;
+  *iv = e->iv;
+  *length = e->length;
   return 0;
 }
 
@@ -3788,34 +5749,42 @@ nestegg_packet_offsets(nestegg_packet * pkt,
                        uint32_t const ** partition_offsets,
                        uint8_t * num_partitions)
 {
-  struct frame * f = pkt->frame;
+  struct frame_encryption * e = pkt->encryption;
   unsigned char encrypted_bit;
   unsigned char partitioned_bit;
 
   *partition_offsets = NULL;
   *num_partitions = 0;
 
-  if (!f->frame_encryption)
+  if (!e)
     return -1;
 
   /* Should never have parsed blocks with both encryption and lacing */
-  assert(f->next == NULL);
+  assert(pkt->frame_count == 1);
 
-  encrypted_bit = f->frame_encryption->signal_byte & ENCRYPTED_BIT_MASK;
-  partitioned_bit = f->frame_encryption->signal_byte & PARTITIONED_BIT_MASK;
+  encrypted_bit = e->signal_byte & ENCRYPTED_BIT_MASK;
+  partitioned_bit = e->signal_byte & PARTITIONED_BIT_MASK;
 
   if (encrypted_bit != PACKET_ENCRYPTED || partitioned_bit != PACKET_PARTITIONED)
     return -1;
 
-  *num_partitions = f->frame_encryption->num_partitions;
-  *partition_offsets = f->frame_encryption->partition_offsets;
+  *num_partitions = e->num_partitions;
+  *partition_offsets = e->partition_offsets;
+  return 0;
+}
+
+int
+nestegg_get_io_stats(nestegg * ctx, nestegg_io_stats * stats)
+{
+  *stats = ctx->io.stats;
+  stats->buffer_size = ctx->io.buf_size;
   return 0;
 }
 
 int
 nestegg_has_cues(nestegg * ctx)
 {
-  return ctx->segment.cues.cue_point.head ||
+  return ctx->cue_index || ctx->segment.cues.cue_point.head ||
     ne_find_seek_for_id(ctx->segment.seek_head.head, ID_CUES);
 }
 
@@ -3846,6 +5815,22 @@ int nestegg_sniff_mkv(unsigned char const* buffer, size_t length)
   return ne_sniff(buffer, length, DOCTYPE_MKV);
 }
 
+/* Whether id ends an unknown-sized Cluster. */
+static int
+ne_is_top_level_id(uint64_t id)
+{
+  return id == ID_EBML        ||
+         id == ID_SEGMENT     ||
+         id == ID_SEEK_HEAD   ||
+         id == ID_INFO        ||
+         id == ID_TRACKS      ||
+         id == ID_CHAPTERS    ||
+         id == ID_CLUSTER     ||
+         id == ID_CUES        ||
+         id == ID_ATTACHMENTS ||
+         id == ID_TAGS;
+}
+
 /* Count frames in a Block/SimpleBlock from its lacing header, then skip the
    remaining payload. Sets frames_out on success; returns 1 on success, <0 on error. */
 static int
@@ -3973,25 +5958,6 @@ ne_sum_block_or_group(nestegg * ctx, uint64_t id, uint64_t size, uint64_t * fram
   return 1;
 }
 
-/* Returns non-zero if 'size' equals the EBML unknown-size pattern for any VINT
-   length. Patterns (data bits all 1): 0x7F, 0x3FFF, 0x1FFFFF, 0x0FFFFFFF,
-   0x07FFFFFFFF, 0x03FFFFFFFFFF, 0x01FFFFFFFFFFFF, 0x00FFFFFFFFFFFFFF. */
-static int
-ne_size_is_unknown(uint64_t size)
-{
-  int len;
-  for (len = 1; len <= 8; ++len) {
-    uint64_t mask;
-    if (len == 8)
-      mask = 0x00FFFFFFFFFFFFFFULL;  /* 56 data bits = all ones */
-    else
-      mask = (1ULL << (7 * len)) - 1ULL; /* 7 data bits per byte */
-    if (size == mask)
-      return 1;
-  }
-  return 0;
-}
-
 /* Read ONE Cluster and return the sum of frames of ALL SimpleBlock/Block in it.
    Returns 1 on success (Cluster found), 0 on clean EOS before any Cluster,
    <0 on error. */
@@ -4034,18 +6000,8 @@ ne_read_cluster_frames_count(nestegg * ctx, uint64_t * frames_out)
           return r;
 
         /* Stop at next top-level element without consuming it. */
-        if (nid == ID_EBML        ||
-            nid == ID_SEGMENT     ||
-            nid == ID_SEEK_HEAD   ||
-            nid == ID_INFO        ||
-            nid == ID_TRACKS      ||
-            nid == ID_CHAPTERS    ||
-            nid == ID_CLUSTER     ||
-            nid == ID_CUES        ||
-            nid == ID_ATTACHMENTS ||
-            nid == ID_TAGS) {
+        if (ne_is_top_level_id(nid))
           break;
-        }
 
         r = ne_read_element(ctx, &nid, &nsize);
         if (r != 1)
@@ -4130,3 +6086,1150 @@ nestegg_read_total_frames_count(nestegg * context, uint64_t * frames_out)
   *frames_out = totalFrames;
   return 0;
 }
+
+/* Find where the element with the 4 byte ID id whose payload starts at
+   data begins, by checking each possible length of its size field. */
+static int64_t
+ne_find_element_start(nestegg * ctx, uint64_t id, int64_t data)
+{
+  unsigned char buf[4 + 8];
+  unsigned int length;
+  int64_t start;
+
+  for (length = 1; length <= 8; ++length) {
+    start = data - 4 - length;
+    if (start < 0)
+      break;
+    if (ne_io_seek(&ctx->io, start, NESTEGG_SEEK_SET) != 0 ||
+        ne_io_read(&ctx->io, buf, 4 + length) != 1)
+      return -1;
+    if (ne_load_be(buf, 4, 4) == id && ne_vint_length(buf[4]) == length)
+      return start;
+  }
+
+  return -1;
+}
+
+/* Grow the array at *array, holding count elements of size bytes, to make
+   room for one more. */
+static int
+ne_index_scan_grow(nestegg * ctx, void ** array, unsigned int * capacity,
+                   unsigned int count, size_t size)
+{
+  void * grown;
+  unsigned int n;
+
+  if (count < *capacity)
+    return 0;
+  if (*capacity > UINT_MAX / 2 || *capacity > (size_t) -1 / 2 / size)
+    return -1;
+  n = *capacity ? *capacity * 2 : 64;
+  grown = *array ? ne_realloc(&ctx->alloc, *array, n * size) : ne_malloc(&ctx->alloc, n * size);
+  if (!grown)
+    return -1;
+  *array = grown;
+  *capacity = n;
+  return 0;
+}
+
+/* Read the track number, relative timecode and keyframe flag of the
+   SimpleBlock or BlockGroup with the given payload size, skipping its
+   frames.  A BlockGroup is a keyframe if it has no ReferenceBlock.  Sets
+   *track_number to 0 if there is no Block.  Returns 1 on success, <0 on
+   error. */
+static int
+ne_read_block_key(nestegg * ctx, uint64_t id, uint64_t size, uint64_t * track_number,
+                  int64_t * timecode, int * keyframe)
+{
+  uint64_t length, flags, gid, gsize;
+  int64_t pos, group_end;
+  int r, referenced = 0;
+
+  *track_number = 0;
+
+  if (id == ID_BLOCK_GROUP) {
+    group_end = ne_io_tell(&ctx->io);
+    if (group_end < 0)
+      return -1;
+    group_end += (int64_t) size;
+    for (;;) {
+      pos = ne_io_tell(&ctx->io);
+      if (pos < 0)
+        return -1;
+      if (pos >= group_end)
+        break;
+      r = ne_read_element(ctx, &gid, &gsize);
+      if (r != 1)
+        return r;
+      if (gid == ID_BLOCK && *track_number == 0) {
+        r = ne_read_block_key(ctx, ID_SIMPLE_BLOCK, gsize, track_number, timecode, keyframe);
+        if (r != 1)
+          return r;
+        continue;
+      }
+      if (gid == ID_REFERENCE_BLOCK)
+        referenced = 1;
+      r = ne_io_read_skip(&ctx->io, gsize);
+      if (r != 1)
+        return r;
+    }
+    *keyframe = !referenced;
+    return 1;
+  }
+
+  r = ne_read_vint(&ctx->io, track_number, &length);
+  if (r != 1)
+    return r;
+  r = ne_read_int(&ctx->io, timecode, 2);
+  if (r != 1)
+    return r;
+  r = ne_read_uint(&ctx->io, &flags, 1);
+  if (r != 1)
+    return r;
+  *keyframe = (flags & SIMPLE_BLOCK_FLAGS_KEYFRAME) != 0;
+
+  if (size < length + 3)
+    return -1;
+  return ne_io_read_skip(&ctx->io, size - length - 3);
+}
+
+/* Add the Cluster at start, whose header has just been read, to scan:
+   its Timecode, and for each track whose first Block is a keyframe, an
+   entry.  Only Block headers are read, and reading stops once every track
+   has been seen.  Sets *next to the offset following the Cluster.
+   Returns 1 on success, 0 at the end of the stream, <0 on error.  The
+   Cluster is added if its Timecode was read, even on error. */
+static int
+ne_scan_cluster(nestegg * ctx, int64_t start, uint64_t size, struct ne_index_scan * scan,
+                int64_t * next)
+{
+  struct ne_scan_cluster * cluster;
+  struct ne_scan_entry * entry;
+  uint64_t id, child_size, timecode = 0, track_number, tc_scale;
+  int64_t pos, end, block_timecode;
+  unsigned int track, seen = 0;
+  int r, keyframe, have_timecode = 0;
+
+  tc_scale = ne_get_timecode_scale(ctx);
+  pos = ne_io_tell(&ctx->io);
+  if (pos < 0)
+    return -1;
+  end = ne_size_is_unknown(size) ? -1 : pos + (int64_t) size;
+  memset(scan->seen, 0, ctx->track_count);
+
+  for (;;) {
+    pos = ne_io_tell(&ctx->io);
+    if (pos < 0) {
+      r = -1;
+      break;
+    }
+    if (end >= 0) {
+      /* Skip the remaining Blocks once every track has been seen. */
+      if (pos < end && have_timecode && seen == ctx->track_count) {
+        r = ne_io_read_skip(&ctx->io, (size_t) (end - pos));
+        pos = end;
+      } else {
+        r = 1;
+      }
+      if (r != 1 || pos >= end)
+        break;
+    } else {
+      r = ne_peek_element(ctx, &id, NULL);
+      if (r != 1 || ne_is_top_level_id(id))
+        break;
+    }
+
+    r = ne_read_element(ctx, &id, &child_size);
+    if (r != 1)
+      break;
+
+    if (id == ID_TIMECODE) {
+      r = ne_read_uint(&ctx->io, &timecode, child_size);
+      if (r != 1)
+        break;
+      have_timecode = 1;
+      continue;
+    }
+
+    if (id != ID_SIMPLE_BLOCK && id != ID_BLOCK_GROUP) {
+      r = ne_io_read_skip(&ctx->io, child_size);
+      if (r != 1)
+        break;
+      continue;
+    }
+
+    /* Block elements cannot precede the Timecode. */
+    if (!have_timecode) {
+      r = -1;
+      break;
+    }
+    r = ne_read_block_key(ctx, id, child_size, &track_number, &block_timecode, &keyframe);
+    if (r != 1)
+      break;
+    if (ne_map_track_number_to_index(ctx, track_number, &track) != 0 || scan->seen[track])
+      continue;
+    scan->seen[track] = 1;
+    seen += 1;
+    if (!keyframe)
+      continue;
+
+    if (ne_index_scan_grow(ctx, (void **) &scan->entries, &scan->entry_capacity,
+                           scan->entry_count, sizeof(*scan->entries)) != 0) {
+      r = -1;
+      break;
+    }
+    entry = &scan->entries[scan->entry_count++];
+    entry->tstamp = (int64_t) timecode + block_timecode < 0 ? 0 :
+      ne_saturate_mul_uint64(timecode + block_timecode, tc_scale);
+    entry->position = (uint64_t) (start - ctx->segment_offset);
+    entry->track = track;
+  }
+
+  *next = end >= 0 ? end : pos;
+  if (!have_timecode)
+    return r;
+
+  if (ne_index_scan_grow(ctx, (void **) &scan->clusters, &scan->cluster_capacity,
+                         scan->cluster_count, sizeof(*scan->clusters)) != 0)
+    return -1;
+  cluster = &scan->clusters[scan->cluster_count++];
+  cluster->position = (uint64_t) (start - ctx->segment_offset);
+  cluster->size = (uint64_t) (*next - start);
+  cluster->tstamp = ne_saturate_mul_uint64(timecode, tc_scale);
+
+  return r;
+}
+
+/* Copy the tables of scan into the pool as ctx->cluster_index and
+   ctx->cue_index. */
+static int
+ne_index_scan_finish(nestegg * ctx, struct ne_index_scan const * scan)
+{
+  struct ne_cluster_index * clusters;
+  struct ne_cue_index * index;
+  unsigned int i;
+
+  clusters = ne_pool_alloc(sizeof(*clusters), ctx->alloc_pool);
+  if (!clusters)
+    return -1;
+  clusters->positions = ne_pool_alloc(scan->cluster_count * sizeof(*clusters->positions),
+                                      ctx->alloc_pool);
+  clusters->sizes = ne_pool_alloc(scan->cluster_count * sizeof(*clusters->sizes),
+                                  ctx->alloc_pool);
+  clusters->tstamps = ne_pool_alloc(scan->cluster_count * sizeof(*clusters->tstamps),
+                                    ctx->alloc_pool);
+  if (!clusters->positions || !clusters->sizes || !clusters->tstamps)
+    return -1;
+  for (i = 0; i < scan->cluster_count; ++i) {
+    clusters->positions[i] = scan->clusters[i].position;
+    clusters->sizes[i] = scan->clusters[i].size;
+    clusters->tstamps[i] = scan->clusters[i].tstamp;
+  }
+  clusters->count = scan->cluster_count;
+
+  index = ne_cue_index_alloc(ctx, scan->entry_count);
+  if (!index)
+    return -1;
+  for (i = 0; i < scan->entry_count; ++i)
+    ne_cue_index_add(index, scan->entries[i].tstamp, scan->entries[i].position,
+                     scan->entries[i].track);
+  if (ne_cue_index_finish(ctx, index) != 0)
+    return -1;
+
+  ctx->cluster_index = clusters;
+  return 0;
+}
+
+int
+nestegg_build_index(nestegg * ctx)
+{
+  struct saved_state saved;
+  struct ne_index_scan scan;
+  uint64_t id, size;
+  int64_t start;
+  int r;
+
+  if (ctx->io.push || ne_get_timecode_scale(ctx) == 0)
+    return -1;
+
+  /* The headers were parsed up to the first Cluster. */
+  if (!ctx->first_cluster.last_valid || ctx->first_cluster.last_id != ID_CLUSTER)
+    return -1;
+
+  if (ne_ctx_save(ctx, &saved) != 0)
+    return -1;
+
+  memset(&scan, 0, sizeof(scan));
+  scan.seen = ne_malloc(&ctx->alloc, ctx->track_count);
+  r = scan.seen ? 1 : -1;
+
+  start = r == 1 ?
+    ne_find_element_start(ctx, ID_CLUSTER, ctx->first_cluster.stream_offset) : -1;
+  if (start < 0 || ne_io_seek(&ctx->io, start, NESTEGG_SEEK_SET) != 0)
+    r = -1;
+  ctx->last_valid = 0;
+
+  /* Walk the Segment, reading each Cluster's headers and skipping other
+     elements, until the end of the stream or of the Segment.  start is
+     the offset of the next element, which may already have been peeked. */
+  while (r == 1) {
+    r = ne_read_element(ctx, &id, &size);
+    if (r != 1)
+      break;
+    if (id == ID_CLUSTER) {
+      r = ne_scan_cluster(ctx, start, size, &scan, &start);
+    } else if (ne_is_top_level_id(id) && id != ID_EBML && id != ID_SEGMENT &&
+               !ne_size_is_unknown(size)) {
+      r = ne_io_read_skip(&ctx->io, size);
+      start = ne_io_tell(&ctx->io);
+      if (start < 0)
+        r = -1;
+    } else {
+      r = 0;
+    }
+  }
+
+  /* Errors, such as a truncated final Cluster, end the scan like the end
+     of the stream. */
+  r = scan.cluster_count > 0 ? ne_index_scan_finish(ctx, &scan) : -1;
+
+  ne_free(&ctx->alloc, scan.seen);
+  ne_free(&ctx->alloc, scan.clusters);
+  ne_free(&ctx->alloc, scan.entries);
+
+  if (ne_ctx_restore(ctx, &saved) != 0)
+    return -1;
+
+  return r;
+}
+
+/* Read forward from the Cluster the reader is at, skipping Block payloads,
+   until a Block of track after tstamp.  Sets *position to the start of the
+   last keyframe Block of track at or before tstamp and *cluster_timecode
+   to the Timecode of its Cluster.  Returns 1 if one was found, 0 if not,
+   <0 on error. */
+static int
+ne_find_keyframe(nestegg * ctx, unsigned int track, uint64_t tstamp, int64_t * position,
+                 uint64_t * cluster_timecode)
+{
+  uint64_t id, size, timecode = 0, track_number, tc_scale, block_tstamp;
+  int64_t pos, block_timecode;
+  unsigned int block_track;
+  int r, keyframe, have_timecode = 0, found = 0;
+
+  tc_scale = ne_get_timecode_scale(ctx);
+  if (tc_scale == 0)
+    return -1;
+
+  for (;;) {
+    pos = ne_io_tell(&ctx->io);
+    if (pos < 0) {
+      r = -1;
+      break;
+    }
+    r = ne_read_element(ctx, &id, &size);
+    if (r != 1)
+      break;
+
+    /* Enter Clusters; their children are read in turn. */
+    if (id == ID_CLUSTER) {
+      have_timecode = 0;
+      continue;
+    }
+
+    if (id == ID_TIMECODE) {
+      r = ne_read_uint(&ctx->io, &timecode, size);
+      if (r != 1)
+        break;
+      have_timecode = 1;
+      continue;
+    }
+
+    if (id != ID_SIMPLE_BLOCK && id != ID_BLOCK_GROUP) {
+      if (ne_size_is_unknown(size)) {
+        r = 0;
+        break;
+      }
+      r = ne_io_read_skip(&ctx->io, size);
+      if (r != 1)
+        break;
+      continue;
+    }
+
+    /* Block elements cannot precede the Timecode. */
+    if (!have_timecode) {
+      r = -1;
+      break;
+    }
+    r = ne_read_block_key(ctx, id, size, &track_number, &block_timecode, &keyframe);
+    if (r != 1)
+      break;
+    if (ne_map_track_number_to_index(ctx, track_number, &block_track) != 0 ||
+        block_track != track)
+      continue;
+
+    block_tstamp = (int64_t) timecode + block_timecode < 0 ? 0 :
+      ne_saturate_mul_uint64(timecode + block_timecode, tc_scale);
+    if (block_tstamp > tstamp)
+      break;
+    if (keyframe) {
+      *position = pos;
+      *cluster_timecode = timecode;
+      found = 1;
+    }
+  }
+
+  if (found)
+    return 1;
+  return r < 0 ? r : 0;
+}
+
+/* Check the first Block of the Cluster being read, skipping any other
+   children, for a track in the stream and a size within the Cluster,
+   which ends at end unless it is negative.  Returns 1 if the Cluster
+   ends, or the stream ends, before a Block or the Block is plausible, 0
+   if not. */
+static int
+ne_check_cluster_block(nestegg * ctx, int64_t end)
+{
+  uint64_t id, size, length, track_number;
+  int64_t pos, block_timecode;
+  unsigned int track;
+  int r, keyframe;
+
+  for (;;) {
+    pos = ne_io_tell(&ctx->io);
+    if (pos < 0)
+      return 0;
+    if (end >= 0 && pos >= end)
+      return 1;
+    r = ne_read_id(&ctx->io, &id, NULL);
+    if (r != 1)
+      return r == 0;
+    /* An unknown-sized Cluster may hold no Blocks at all. */
+    if (end < 0 && ne_is_top_level_id(id))
+      return 1;
+    r = ne_read_vint(&ctx->io, &size, &length);
+    if (r != 1)
+      return r == 0;
+    /* Only a size of all ones in its own length is unknown here, so that
+       a 127 byte Block coded in two bytes is not rejected. */
+    if (size == (1ULL << (7 * length)) - 1)
+      return 0;
+    pos = ne_io_tell(&ctx->io);
+    if (pos < 0 || (end >= 0 && size > (uint64_t) (end - pos)))
+      return 0;
+    if (id == ID_SIMPLE_BLOCK || id == ID_BLOCK_GROUP)
+      break;
+    r = ne_io_read_skip(&ctx->io, size);
+    if (r != 1)
+      return r == 0;
+  }
+
+  r = ne_read_block_key(ctx, id, size, &track_number, &block_timecode, &keyframe);
+  if (r != 1)
+    return r == 0;
+  return (unsigned int) track_number == track_number &&
+         ne_map_track_number_to_index(ctx, (unsigned int) track_number, &track) == 0;
+}
+
+/* Read the header of the Cluster at start and its Timecode, which must be
+   its first child other than CRC-32 and Void elements, and check its first
+   Block.  Sets *next to the offset following the Cluster, or its Timecode
+   if its size is unknown.  Returns 1 if a Cluster was read, 0 if start
+   does not hold one, -1 on error. */
+static int
+ne_read_cluster_header(nestegg * ctx, int64_t start, uint64_t * timecode, int64_t * next)
+{
+  uint64_t id, size, child_size;
+  int64_t data, end;
+  int r;
+
+  ctx->last_valid = 0;
+  if (ne_io_seek(&ctx->io, start, NESTEGG_SEEK_SET) != 0)
+    return -1;
+  r = ne_read_id(&ctx->io, &id, NULL);
+  if (r != 1 || id != ID_CLUSTER)
+    return r < 0 ? -1 : 0;
+
+  /* Past the ID, a candidate that cannot be read is not a Cluster. */
+  r = ne_read_vint(&ctx->io, &size, NULL);
+  if (r != 1)
+    return 0;
+  data = ne_io_tell(&ctx->io);
+  if (data < 0)
+    return -1;
+  if (ne_size_is_unknown(size))
+    end = -1;
+  else if (size > (uint64_t) (INT64_MAX - data))
+    return 0;
+  else
+    end = data + (int64_t) size;
+
+  for (;;) {
+    r = ne_read_id(&ctx->io, &id, NULL);
+    if (r != 1)
+      return 0;
+    r = ne_read_vint(&ctx->io, &child_size, NULL);
+    if (r != 1)
+      return 0;
+    if (id == ID_TIMECODE)
+      break;
+    if ((id != ID_CRC32 && id != ID_VOID) || ne_size_is_unknown(child_size))
+      return 0;
+    data = ne_io_tell(&ctx->io);
+    if (data < 0)
+      return -1;
+    if (end >= 0 && (data > end || child_size > (uint64_t) (end - data)))
+      return 0;
+    r = ne_io_read_skip(&ctx->io, child_size);
+    if (r != 1)
+      return 0;
+  }
+  if (child_size == 0 || child_size > 8)
+    return 0;
+  r = ne_read_uint(&ctx->io, timecode, child_size);
+  if (r != 1)
+    return 0;
+
+  data = ne_io_tell(&ctx->io);
+  if (data < 0)
+    return -1;
+  if (end >= 0 && data > end)
+    return 0;
+  if (!ne_check_cluster_block(ctx, end))
+    return 0;
+  *next = end < 0 ? data : end;
+  return 1;
+}
+
+/* Find the first Cluster starting at or after offset, and before limit
+   unless it is negative, by scanning the bytes in memory for its ID and
+   reading the header of each candidate.  Sets *start and, as
+   ne_read_cluster_header, *timecode and *next.  Returns 1 if one was
+   found, 0 if not, -1 on error. */
+static int
+ne_next_cluster(nestegg * ctx, int64_t offset, int64_t limit, int64_t * start,
+                uint64_t * timecode, int64_t * next)
+{
+  unsigned char const * view, * p, * end;
+  size_t n;
+  int r;
+
+  for (;;) {
+    if (limit >= 0 && offset >= limit)
+      return 0;
+    if (ne_io_seek(&ctx->io, offset, NESTEGG_SEEK_SET) != 0)
+      return 0;
+    r = ne_io_peek_fill(&ctx->io, &view, &n);
+    if (r != 1)
+      return r;
+    end = view + n;
+    if (limit >= 0 && (int64_t) n > limit - offset)
+      end = view + (size_t) (limit - offset);
+
+    /* An ID running past the bytes in memory is left to the header
+       read to check. */
+    for (p = view; (p = memchr(p, ID_CLUSTER >> 24, (size_t) (end - p))); ++p)
+      if (n - (size_t) (p - view) < 4 || ne_load_be(p, 4, 4) == ID_CLUSTER)
+        break;
+    if (!p) {
+      offset += end - view;
+      continue;
+    }
+
+    offset += p - view;
+    *start = offset;
+    r = ne_read_cluster_header(ctx, offset, timecode, next);
+    if (r != 0)
+      return r;
+    offset += 1;
+  }
+}
+
+/* The offset following the Segment, or -1 if its size is unknown. */
+static int64_t
+ne_segment_end(nestegg * ctx)
+{
+  int64_t start;
+  uint64_t size;
+
+  start = ne_find_element_start(ctx, ID_SEGMENT, ctx->segment_offset);
+  if (start < 0 || ne_io_seek(&ctx->io, start + 4, NESTEGG_SEEK_SET) != 0 ||
+      ne_read_vint(&ctx->io, &size, NULL) != 1 || ne_size_is_unknown(size) ||
+      size > (uint64_t) (INT64_MAX - ctx->segment_offset))
+    return -1;
+  return ctx->segment_offset + (int64_t) size;
+}
+
+/* Find the last Cluster of clusters starting at or before tstamp, or the
+   first if all are later. */
+static unsigned int
+ne_cluster_index_find(struct ne_cluster_index const * clusters, uint64_t tstamp)
+{
+  unsigned int lo = 0, hi = clusters->count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (clusters->tstamps[mid] > tstamp)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+/* Seek to the start of the last Cluster holding a keyframe of track at or
+   before tstamp without Cues.  Clusters are in time order, so the range
+   from the first Cluster to the end of the Segment is bisected, probing
+   the first Cluster after each midpoint, and the last few Clusters are
+   stepped through in turn.  If the Segment size is unknown, the range
+   grows from the first Cluster in doubling steps until a probe passes
+   tstamp or the end of the stream.  The Clusters found by
+   nestegg_build_index, if any, are bisected in memory instead.  If the
+   Cluster found has no such keyframe, the search repeats before it.  The
+   parser state is left for the caller to restore on error. */
+static int
+ne_cluster_bisect_seek(nestegg * ctx, unsigned int track, uint64_t tstamp)
+{
+  struct ne_cluster_index const * clusters = ctx->cluster_index;
+  int64_t first, first_next, lo, lo_next, hi, mid, start, next, step, position;
+  uint64_t tc_scale, first_tstamp, lo_tstamp, timecode;
+  unsigned int i;
+  int r;
+
+  tc_scale = ne_get_timecode_scale(ctx);
+  if (tc_scale == 0 || !ctx->first_cluster.last_valid ||
+      ctx->first_cluster.last_id != ID_CLUSTER)
+    return -1;
+  first = ne_find_element_start(ctx, ID_CLUSTER, ctx->first_cluster.stream_offset);
+  if (first < 0 || ne_read_cluster_header(ctx, first, &timecode, &first_next) != 1)
+    return -1;
+  first_tstamp = ne_saturate_mul_uint64(timecode, tc_scale);
+  hi = ne_segment_end(ctx);
+
+  for (;;) {
+    /* The Cluster at lo is at or before tstamp, and so is every Cluster
+       before it; every Cluster starting at or after hi is later. */
+    lo = first;
+    lo_next = first_next;
+    lo_tstamp = first_tstamp;
+    if (lo_tstamp > tstamp)
+      break;
+
+    if (clusters && clusters->count > 0) {
+      /* Bisect the Clusters found by nestegg_build_index in memory. */
+      i = ne_cluster_index_find(clusters, tstamp);
+      if (clusters->tstamps[i] <= tstamp &&
+          clusters->positions[i] <= (uint64_t) (INT64_MAX - ctx->segment_offset)) {
+        lo = ctx->segment_offset + (int64_t) clusters->positions[i];
+        lo_tstamp = clusters->tstamps[i];
+      }
+    } else {
+      for (step = CLUSTER_BISECT_SIZE; hi < 0; step *= 2) {
+        if (step > (INT64_MAX - lo) / 2)
+          return -1;
+        r = ne_next_cluster(ctx, lo + step, -1, &start, &timecode, &next);
+        if (r < 0)
+          return -1;
+        if (r == 0 || ne_saturate_mul_uint64(timecode, tc_scale) > tstamp) {
+          hi = lo + step;
+        } else {
+          lo = start;
+          lo_next = next;
+          lo_tstamp = ne_saturate_mul_uint64(timecode, tc_scale);
+        }
+      }
+
+      while (hi - lo > CLUSTER_BISECT_SIZE) {
+        mid = lo + (hi - lo) / 2;
+        r = ne_next_cluster(ctx, mid, hi, &start, &timecode, &next);
+        if (r < 0)
+          return -1;
+        if (r == 0 || ne_saturate_mul_uint64(timecode, tc_scale) > tstamp) {
+          hi = mid;
+        } else {
+          lo = start;
+          lo_next = next;
+          lo_tstamp = ne_saturate_mul_uint64(timecode, tc_scale);
+        }
+      }
+
+      for (;;) {
+        r = ne_next_cluster(ctx, lo_next, hi, &start, &timecode, &next);
+        if (r < 0)
+          return -1;
+        if (r == 0 || ne_saturate_mul_uint64(timecode, tc_scale) > tstamp)
+          break;
+        lo = start;
+        lo_next = next;
+        lo_tstamp = ne_saturate_mul_uint64(timecode, tc_scale);
+      }
+    }
+
+    if (ne_io_seek(&ctx->io, lo, NESTEGG_SEEK_SET) != 0)
+      return -1;
+    ctx->last_valid = 0;
+    r = ne_find_keyframe(ctx, track, tstamp, &position, &timecode);
+    if (r < 0)
+      return -1;
+    if (r == 1 || lo == first || lo_tstamp == 0)
+      break;
+    ctx->log(ctx, NESTEGG_LOG_DEBUG, "seek: no keyframe in cluster at %lld",
+             (long long) lo);
+    tstamp = lo_tstamp - 1;
+    hi = lo;
+  }
+
+  return nestegg_offset_seek(ctx, (uint64_t) lo);
+}
+
+int
+nestegg_offset_seek_resync(nestegg * ctx, uint64_t offset, uint64_t * cluster)
+{
+  struct saved_state state;
+  int64_t first, start, next;
+  uint64_t timecode;
+  int r;
+
+  if (!cluster || offset > INT64_MAX || !ctx->first_cluster.last_valid ||
+      ctx->first_cluster.last_id != ID_CLUSTER)
+    return -1;
+
+  if (ne_ctx_save(ctx, &state) != 0)
+    return -1;
+
+  /* The Cluster ID may appear in the headers, as in a SeekHead entry. */
+  first = ne_find_element_start(ctx, ID_CLUSTER, ctx->first_cluster.stream_offset);
+  if (first >= 0 && (int64_t) offset < first)
+    offset = (uint64_t) first;
+
+  r = ne_next_cluster(ctx, (int64_t) offset, ne_segment_end(ctx), &start, &timecode, &next);
+  if (r != 1 || nestegg_offset_seek(ctx, (uint64_t) start) != 0) {
+    if (ne_ctx_restore(ctx, &state) != 0)
+      return -1;
+    return -1;
+  }
+
+  *cluster = (uint64_t) start;
+  return 0;
+}
+
+int
+nestegg_track_seek(nestegg * ctx, unsigned int track, uint64_t tstamp)
+{
+  int r;
+  unsigned int entry;
+  uint64_t position;
+  struct saved_state state;
+
+  if (track >= ctx->track_count)
+    return -1;
+
+  /* Look up Cues that follow the first Cluster on disk rather than load
+     them, falling back to loading them if that fails. */
+  if (ctx->cue_window != 0 && !ctx->cue_index && !ctx->segment.cues.cue_point.head) {
+    if (ne_ctx_save(ctx, &state) != 0)
+      return -1;
+    r = ne_cue_window_find(ctx, track, tstamp, &position);
+    if (ne_ctx_restore(ctx, &state) != 0)
+      return -1;
+    if (r == 1)
+      return nestegg_offset_seek(ctx, ctx->segment_offset + position);
+    ctx->log(ctx, NESTEGG_LOG_DEBUG, "seek: bounded cue lookup failed, loading cues");
+  }
+
+  /* Without Cues, or if they list no Clusters for track, as is usual for
+     the audio track of a stream with video, bisect the Clusters on disk. */
+  r = ne_init_cue_points(ctx, -1);
+  if (r != 0 || ne_cue_index_find(ctx->cue_index, track, tstamp, &entry) != 0) {
+    if (ne_ctx_save(ctx, &state) != 0)
+      return -1;
+    if (ne_cluster_bisect_seek(ctx, track, tstamp) == 0)
+      return 0;
+    if (ne_ctx_restore(ctx, &state) != 0)
+      return -1;
+    return -1;
+  }
+
+  /* Seek to (we assume) the start of a Cluster element. */
+  r = nestegg_offset_seek(ctx, ctx->segment_offset + ctx->cue_index->positions[entry]);
+  if (r != 0)
+    return -1;
+
+  return 0;
+}
+
+int
+nestegg_track_seek_precise(nestegg * ctx, unsigned int track, uint64_t tstamp)
+{
+  struct track_entry * entry;
+  struct saved_state state;
+  uint64_t type, preroll, cluster_timecode;
+  int64_t position;
+  int r;
+
+  entry = ne_find_track_entry(ctx, track);
+  if (!entry)
+    return -1;
+
+  /* Audio decoders must decode and discard the SeekPreRoll before tstamp. */
+  if (ne_get_uint(entry->type, &type) == 0 && type == TRACK_TYPE_AUDIO &&
+      ne_get_uint(entry->seek_preroll, &preroll) == 0)
+    tstamp = tstamp > preroll ? tstamp - preroll : 0;
+
+  if (nestegg_track_seek(ctx, track, tstamp) != 0)
+    return -1;
+
+  if (ne_ctx_save(ctx, &state) != 0)
+    return -1;
+  r = ne_find_keyframe(ctx, track, tstamp, &position, &cluster_timecode);
+  if (r != 1) {
+    /* Stay at the start of the Cluster the seek found. */
+    ctx->log(ctx, NESTEGG_LOG_DEBUG, "seek: no keyframe at or before %llu",
+             (unsigned long long) tstamp);
+    return ne_ctx_restore(ctx, &state);
+  }
+
+  /* Resume reading at the Block, inside its Cluster. */
+  ctx->cluster_timecode = cluster_timecode;
+  ctx->read_cluster_timecode = 1;
+  return nestegg_offset_seek(ctx, (uint64_t) position);
+}
+
+static char const ne_index_magic[8] = "nestidx";
+
+static void
+ne_index_layout(struct ne_index_header const * h, struct ne_index_layout * l)
+{
+  uint64_t o = sizeof(*h);
+
+  l->ranges = o;
+  o += (uint64_t) h->range_count * 2 * sizeof(int64_t);
+  l->cue_tstamps = o;
+  o += (uint64_t) h->cue_count * sizeof(uint64_t);
+  l->cue_positions = o;
+  o += (uint64_t) h->cue_count * sizeof(uint64_t);
+  l->cue_tracks = o;
+  o += (uint64_t) h->cue_count * sizeof(uint32_t);
+  l->cue_by_track = o;
+  o += (uint64_t) h->cue_count * sizeof(uint32_t);
+  l->cue_track_first = o;
+  o = INDEX_ALIGN(o + ((uint64_t) h->track_count + 1) * sizeof(uint32_t));
+  l->cluster_positions = o;
+  o += (uint64_t) h->cluster_count * sizeof(uint64_t);
+  l->cluster_sizes = o;
+  o += (uint64_t) h->cluster_count * sizeof(uint64_t);
+  l->cluster_tstamps = o;
+  o += (uint64_t) h->cluster_count * sizeof(uint64_t);
+  l->length = o;
+}
+
+static uint64_t
+ne_index_checksum(unsigned char const * index, size_t length)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = offsetof(struct ne_index_header, key); i < length; ++i) {
+    hash ^= index[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/* Find the SeekHead, Info and Tracks elements before the first Cluster,
+   storing each as a start and end offset pair. */
+static int
+ne_index_find_ranges(nestegg * ctx, int64_t * ranges, uint32_t * count)
+{
+  uint64_t id, size;
+  int64_t pos, data, first_cluster;
+
+  first_cluster = ne_find_element_start(ctx, ID_CLUSTER, ctx->first_cluster.stream_offset);
+  if (first_cluster < 0)
+    return -1;
+
+  *count = 0;
+  for (pos = ctx->segment_offset; pos < first_cluster; pos = data + (int64_t) size) {
+    if (ne_io_seek(&ctx->io, pos, NESTEGG_SEEK_SET) != 0 ||
+        ne_read_id(&ctx->io, &id, NULL) != 1 ||
+        ne_read_vint(&ctx->io, &size, NULL) != 1)
+      return -1;
+    data = ne_io_tell(&ctx->io);
+    if (data < 0 || ne_size_is_unknown(size) || size > (uint64_t) (first_cluster - data))
+      return -1;
+    if (id != ID_SEEK_HEAD && id != ID_INFO && id != ID_TRACKS)
+      continue;
+    if (*count == INDEX_MAX_RANGES)
+      return -1;
+    ranges[*count * 2] = pos;
+    ranges[*count * 2 + 1] = data + (int64_t) size;
+    *count += 1;
+  }
+
+  return 0;
+}
+
+int
+nestegg_save_index(nestegg * ctx, uint64_t key, void * buffer, size_t * length)
+{
+  struct ne_index_header h;
+  struct ne_index_layout l;
+  struct saved_state saved;
+  struct ne_cue_index const * cues;
+  struct ne_cluster_index const * clusters;
+  int64_t ranges[INDEX_MAX_RANGES * 2];
+  unsigned char * out = buffer;
+  int r;
+
+  if (!length || ctx->io.push || sizeof(unsigned int) != sizeof(uint32_t))
+    return -1;
+  if (!ctx->first_cluster.last_valid || ctx->first_cluster.last_id != ID_CLUSTER)
+    return -1;
+
+  /* Include the Cues if there are any, loading them if need be. */
+  if (!ctx->cue_index)
+    ne_init_cue_points(ctx, -1);
+  cues = ctx->cue_index;
+  clusters = ctx->cluster_index;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, ne_index_magic, sizeof(h.magic));
+  h.version = INDEX_VERSION;
+  h.byte_order = INDEX_BYTE_ORDER;
+  h.key = key;
+  h.segment_offset = ctx->segment_offset;
+  h.first_cluster = ctx->first_cluster.stream_offset;
+  h.first_cluster_size = ctx->first_cluster.last_size;
+  h.track_count = ctx->track_count;
+  h.cue_count = cues ? cues->count : 0;
+  h.cluster_count = clusters ? clusters->count : 0;
+
+  if (ne_ctx_save(ctx, &saved) != 0)
+    return -1;
+  r = ne_index_find_ranges(ctx, ranges, &h.range_count);
+  if (ne_ctx_restore(ctx, &saved) != 0 || r != 0)
+    return -1;
+
+  ne_index_layout(&h, &l);
+  if (l.length > (size_t) -1)
+    return -1;
+  h.length = l.length;
+  if (!out || *length < l.length) {
+    *length = (size_t) l.length;
+    return -1;
+  }
+
+  memset(out, 0, (size_t) l.length);
+  memcpy(out + l.ranges, ranges, h.range_count * 2 * sizeof(*ranges));
+  if (cues) {
+    memcpy(out + l.cue_tstamps, cues->tstamps, cues->count * sizeof(*cues->tstamps));
+    memcpy(out + l.cue_positions, cues->positions, cues->count * sizeof(*cues->positions));
+    memcpy(out + l.cue_tracks, cues->tracks, cues->count * sizeof(*cues->tracks));
+    memcpy(out + l.cue_by_track, cues->by_track, cues->count * sizeof(*cues->by_track));
+    memcpy(out + l.cue_track_first, cues->track_first,
+           (ctx->track_count + 1) * sizeof(*cues->track_first));
+  }
+  if (clusters) {
+    memcpy(out + l.cluster_positions, clusters->positions,
+           clusters->count * sizeof(*clusters->positions));
+    memcpy(out + l.cluster_sizes, clusters->sizes, clusters->count * sizeof(*clusters->sizes));
+    memcpy(out + l.cluster_tstamps, clusters->tstamps,
+           clusters->count * sizeof(*clusters->tstamps));
+  }
+  memcpy(out, &h, sizeof(h));
+  h.checksum = ne_index_checksum(out, (size_t) l.length);
+  memcpy(out, &h, sizeof(h));
+
+  *length = (size_t) l.length;
+  return 0;
+}
+
+/* Point *table at the table at offset of index, or at a copy in the pool
+   if index is not suitably aligned. */
+static int
+ne_index_table(nestegg * ctx, unsigned char const * index, uint64_t offset, size_t size,
+               void ** table)
+{
+  unsigned char const * p = index + offset;
+
+  if ((size_t) p % sizeof(uint64_t) == 0) {
+    *table = (void *) p;
+    return 0;
+  }
+  *table = ne_pool_alloc(size, ctx->alloc_pool);
+  if (!*table)
+    return -1;
+  memcpy(*table, p, size);
+  return 0;
+}
+
+/* Install the cue and cluster tables of a validated index. */
+static int
+ne_index_load_tables(nestegg * ctx, struct ne_index_header const * h,
+                     struct ne_index_layout const * l, unsigned char const * index)
+{
+  struct ne_cue_index * cues;
+  struct ne_cluster_index * clusters;
+  unsigned int i, track;
+
+  if (h->cue_count > 0) {
+    cues = ne_pool_alloc(sizeof(*cues), ctx->alloc_pool);
+    if (!cues ||
+        ne_index_table(ctx, index, l->cue_tstamps, h->cue_count * sizeof(uint64_t),
+                       (void **) &cues->tstamps) != 0 ||
+        ne_index_table(ctx, index, l->cue_positions, h->cue_count * sizeof(uint64_t),
+                       (void **) &cues->positions) != 0 ||
+        ne_index_table(ctx, index, l->cue_tracks, h->cue_count * sizeof(uint32_t),
+                       (void **) &cues->tracks) != 0 ||
+        ne_index_table(ctx, index, l->cue_by_track, h->cue_count * sizeof(uint32_t),
+                       (void **) &cues->by_track) != 0 ||
+        ne_index_table(ctx, index, l->cue_track_first,
+                       (h->track_count + 1) * sizeof(uint32_t),
+                       (void **) &cues->track_first) != 0)
+      return -1;
+    cues->count = h->cue_count;
+
+    /* The tables must describe a well formed index: each track's
+       entries follow the previous track's and are in time order. */
+    if (cues->track_first[0] != 0 || cues->track_first[ctx->track_count] != cues->count)
+      return -1;
+    for (track = 0; track < ctx->track_count; ++track) {
+      if (cues->track_first[track + 1] < cues->track_first[track])
+        return -1;
+      for (i = cues->track_first[track]; i < cues->track_first[track + 1]; ++i) {
+        if (cues->by_track[i] >= cues->count || cues->tracks[cues->by_track[i]] != track)
+          return -1;
+        if (i > cues->track_first[track] &&
+            cues->tstamps[cues->by_track[i]] < cues->tstamps[cues->by_track[i - 1]])
+          return -1;
+      }
+    }
+    ctx->cue_index = cues;
+  }
+
+  if (h->cluster_count > 0) {
+    clusters = ne_pool_alloc(sizeof(*clusters), ctx->alloc_pool);
+    if (!clusters ||
+        ne_index_table(ctx, index, l->cluster_positions, h->cluster_count * sizeof(uint64_t),
+                       (void **) &clusters->positions) != 0 ||
+        ne_index_table(ctx, index, l->cluster_sizes, h->cluster_count * sizeof(uint64_t),
+                       (void **) &clusters->sizes) != 0 ||
+        ne_index_table(ctx, index, l->cluster_tstamps, h->cluster_count * sizeof(uint64_t),
+                       (void **) &clusters->tstamps) != 0)
+      return -1;
+    clusters->count = h->cluster_count;
+    ctx->cluster_index = clusters;
+  }
+
+  return 0;
+}
+
+/* Parse only the EBML header, the Segment header and the element ranges
+   recorded in index, then install its tables and position the reader at
+   the first Cluster. */
+static int
+ne_context_parse_indexed(nestegg * ctx, unsigned char const * index, size_t length,
+                         uint64_t key)
+{
+  struct ne_index_header h;
+  struct ne_index_layout l;
+  int64_t ranges[INDEX_MAX_RANGES * 2], start;
+  struct ebml_element_desc * element;
+  unsigned int i, depth;
+  uint64_t id, size;
+  int r;
+
+  if (!index || length < sizeof(h) || sizeof(unsigned int) != sizeof(uint32_t))
+    return -1;
+  memcpy(&h, index, sizeof(h));
+  if (memcmp(h.magic, ne_index_magic, sizeof(h.magic)) != 0 ||
+      h.version != INDEX_VERSION || h.byte_order != INDEX_BYTE_ORDER ||
+      h.key != key || h.range_count > INDEX_MAX_RANGES || h.segment_offset <= 0 ||
+      h.first_cluster <= h.segment_offset)
+    return -1;
+  ne_index_layout(&h, &l);
+  if (h.length != l.length || l.length > length ||
+      h.checksum != ne_index_checksum(index, (size_t) l.length))
+    return -1;
+  memcpy(ranges, index + l.ranges, h.range_count * 2 * sizeof(*ranges));
+
+  if (ne_io_seek(&ctx->io, 0, NESTEGG_SEEK_SET) != 0)
+    return -1;
+  ctx->last_valid = 0;
+  r = ne_peek_element(ctx, &id, NULL);
+  if (r != 1 || id != ID_EBML)
+    return -1;
+
+  /* Parse up to the payload of the Segment, leaving its context pushed for
+     the recorded elements. */
+  if (ne_ctx_push(ctx, ne_top_level_elements, ctx) < 0)
+    return -1;
+  r = ne_parse_with_io_limit(ctx, NULL, h.segment_offset);
+  if (r == 1) {
+    /* The parse stops with the Segment header peeked; enter it here. */
+    element = ne_find_element(ctx, ID_SEGMENT, ctx->ancestor);
+    if (!element || ne_read_element(ctx, &id, &size) != 1 || id != ID_SEGMENT ||
+        ne_io_tell(&ctx->io) != h.segment_offset ||
+        ne_read_single_master(ctx, element) < 0)
+      r = -1;
+    else
+      ctx->segment_offset = h.segment_offset;
+  }
+
+  depth = ctx->ancestor_depth;
+  for (i = 0; r == 1 && i < h.range_count; ++i) {
+    if (ranges[i * 2] < h.segment_offset || ranges[i * 2 + 1] <= ranges[i * 2] ||
+        ne_io_seek(&ctx->io, ranges[i * 2], NESTEGG_SEEK_SET) != 0) {
+      r = -1;
+      break;
+    }
+    ctx->last_valid = 0;
+    r = ne_parse_with_io_limit(ctx, NULL, ranges[i * 2 + 1]);
+    while (ctx->ancestor && ctx->ancestor_depth > depth)
+      ne_ctx_pop(ctx);
+  }
+  while (ctx->ancestor)
+    ne_ctx_pop(ctx);
+
+  if (r != 1 || ne_context_check_headers(ctx) != 0 || h.track_count != ctx->track_count)
+    return -1;
+
+  if (ne_index_load_tables(ctx, &h, &l, index) != 0)
+    return -1;
+
+  ctx->saved.stream_offset = h.first_cluster;
+  ctx->saved.last_id = ID_CLUSTER;
+  ctx->saved.last_size = h.first_cluster_size;
+  ctx->saved.last_valid = 1;
+  ctx->first_cluster = ctx->saved;
+
+  /* The first Cluster must be where the index says. */
+  start = ne_find_element_start(ctx, ID_CLUSTER, h.first_cluster);
+  if (start < 0 || ne_io_seek(&ctx->io, start + 4, NESTEGG_SEEK_SET) != 0 ||
+      ne_read_vint(&ctx->io, &size, NULL) != 1 || size != h.first_cluster_size)
+    return -1;
+
+  return ne_ctx_restore(ctx, &ctx->saved);
+}
+
+int
+nestegg_init_with_index(nestegg ** context, nestegg_io io, nestegg_log callback,
+                        nestegg_init_options const * options, void const * index,
+                        size_t length, uint64_t key)
+{
+  nestegg * ctx;
+
+  if (ne_context_new(&ctx, io, callback, options) != 0)
+    return -1;
+
+  if (ne_context_parse_indexed(ctx, index, length, key) != 0) {
+    nestegg_destroy(ctx);
+    return -1;
+  }
+
+  *context = ctx;
+  return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright © 2010 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#define NE_HAVE_PTHREAD
+#if !defined(_GNU_SOURCE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(NE_HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+#include "nestegg/nestegg.h"
+
+#define RANGE_BLOCK_SIZE     (1 << 20)
+#define RANGE_BLOCK_MIN_SIZE 512
+#define RANGE_MAX_WORKERS    64
+
+/* Block States */
+#define BLOCK_IDLE      0
+#define BLOCK_QUEUED    1
+#define BLOCK_INFLIGHT  2
+#define BLOCK_DONE      3
+
+/* A fetch of the byte range [offset, offset + length). */
+struct ne_range_block {
+  unsigned char * data;
+  int64_t offset;
+  size_t length;
+  int64_t result; /* bytes fetched, or -1 on error */
+  int state;
+  int orphaned; /* dropped while in flight; idle once the fetch completes */
+};
+
+/* A resource read through a queue of range fetches.  The queued blocks
+   cover the contiguous range [offset of queue[head], next_offset) and are
+   fetched ahead of the position by a pool of workers, lowest offset
+   first; without workers they are fetched synchronously one at a time.
+   Blocks end at the last planned boundary they cover, so that fetches
+   start where seeks to those boundaries land.  The queue is only touched
+   by the reader; block states are shared with the workers under lock. */
+struct ne_range {
+  nestegg_range_fetch fetch;
+  void * userdata;
+  int64_t size;
+  int64_t pos;
+  size_t block_size;
+  unsigned int depth;
+  struct ne_range_block * blocks;
+  unsigned int block_count;
+  unsigned int * queue;
+  unsigned int head;
+  unsigned int count;
+  int64_t next_offset;
+  int64_t * plan;
+  unsigned int plan_count;
+#if defined(NE_HAVE_PTHREAD)
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t * workers;
+  unsigned int worker_count;
+  int shutdown;
+#endif
+};
+
+static void
+ne_range_lock(struct ne_range * r)
+{
+#if defined(NE_HAVE_PTHREAD)
+  if (r->worker_count > 0)
+    pthread_mutex_lock(&r->lock);
+#endif
+}
+
+static void
+ne_range_unlock(struct ne_range * r)
+{
+#if defined(NE_HAVE_PTHREAD)
+  if (r->worker_count > 0)
+    pthread_mutex_unlock(&r->lock);
+#endif
+}
+
+/* Fetch a block in full, retrying short fetches.  Called without the
+   lock held. */
+static int64_t
+ne_range_fetch_block(struct ne_range * r, struct ne_range_block * b)
+{
+  size_t got = 0;
+
+  while (got < b->length) {
+    int64_t n = r->fetch(b->data + got, b->offset + (int64_t) got, b->length - got,
+                         r->userdata);
+    if (n < 0 || (uint64_t) n > b->length - got)
+      return -1;
+    if (n == 0)
+      break;
+    got += (size_t) n;
+  }
+  return (int64_t) got;
+}
+
+#if defined(NE_HAVE_PTHREAD)
+static void *
+ne_range_worker(void * arg)
+{
+  struct ne_range * r = arg;
+  struct ne_range_block * b;
+  unsigned int i;
+  int64_t result;
+
+  pthread_mutex_lock(&r->lock);
+  for (;;) {
+    b = NULL;
+    for (i = 0; i < r->block_count; ++i) {
+      if (r->blocks[i].state == BLOCK_QUEUED &&
+          (!b || r->blocks[i].offset < b->offset))
+        b = &r->blocks[i];
+    }
+    if (!b) {
+      if (r->shutdown)
+        break;
+      pthread_cond_wait(&r->cond, &r->lock);
+      continue;
+    }
+    b->state = BLOCK_INFLIGHT;
+    pthread_mutex_unlock(&r->lock);
+
+    result = ne_range_fetch_block(r, b);
+
+    pthread_mutex_lock(&r->lock);
+    b->result = result;
+    b->state = b->orphaned ? BLOCK_IDLE : BLOCK_DONE;
+    b->orphaned = 0;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+#endif
+
+/* End of the block starting at offset: the last planned boundary within
+   a block's length of it, or a full block if there is none. */
+static int64_t
+ne_range_block_end(struct ne_range * r, int64_t offset)
+{
+  int64_t end = offset + (int64_t) r->block_size;
+  unsigned int lo = 0, hi = r->plan_count;
+
+  if (end > r->size)
+    end = r->size;
+
+  /* Find the first boundary beyond end. */
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if (r->plan[mid] <= end)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0 && r->plan[lo - 1] > offset)
+    end = r->plan[lo - 1];
+  return end;
+}
+
+/* Queue a fetch from offset behind the queued blocks. */
+static void
+ne_range_issue(struct ne_range * r, int64_t offset)
+{
+  struct ne_range_block * b = NULL;
+  unsigned int i;
+
+  ne_range_lock(r);
+  /* Blocks are either queued or orphaned by an in flight fetch, so with
+     depth + workers blocks one is always idle. */
+  for (i = 0; i < r->block_count; ++i) {
+    if (r->blocks[i].state == BLOCK_IDLE) {
+      b = &r->blocks[i];
+      break;
+    }
+  }
+  assert(b);
+  b->offset = offset;
+  b->length = (size_t) (ne_range_block_end(r, offset) - offset);
+  b->result = 0;
+  b->state = BLOCK_QUEUED;
+  r->queue[(r->head + r->count) % r->depth] = i;
+  r->count += 1;
+  r->next_offset = offset + (int64_t) b->length;
+#if defined(NE_HAVE_PTHREAD)
+  if (r->worker_count > 0) {
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+#endif
+  ne_range_unlock(r);
+  b->result = ne_range_fetch_block(r, b);
+  b->state = BLOCK_DONE;
+}
+
+static struct ne_range_block *
+ne_range_head(struct ne_range * r)
+{
+  assert(r->count > 0);
+  return &r->blocks[r->queue[r->head]];
+}
+
+/* Wait for the fetch of the head block to complete. */
+static void
+ne_range_wait(struct ne_range * r)
+{
+  struct ne_range_block * b = ne_range_head(r);
+
+#if defined(NE_HAVE_PTHREAD)
+  if (r->worker_count > 0) {
+    pthread_mutex_lock(&r->lock);
+    while (b->state != BLOCK_DONE)
+      pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+  }
+#endif
+  assert(b->state == BLOCK_DONE);
+}
+
+static void
+ne_range_drop_head(struct ne_range * r)
+{
+  struct ne_range_block * b = ne_range_head(r);
+
+  ne_range_lock(r);
+  if (b->state == BLOCK_INFLIGHT)
+    b->orphaned = 1;
+  else
+    b->state = BLOCK_IDLE;
+  ne_range_unlock(r);
+  r->head = (r->head + 1) % r->depth;
+  r->count -= 1;
+}
+
+/* Arrange for the head block to contain pos and queue the blocks that
+   follow it. */
+static void
+ne_range_locate(struct ne_range * r)
+{
+  if (r->count > 0 && r->pos >= ne_range_head(r)->offset && r->pos < r->next_offset) {
+    while (r->pos >= ne_range_head(r)->offset + (int64_t) ne_range_head(r)->length)
+      ne_range_drop_head(r);
+  } else {
+    while (r->count > 0)
+      ne_range_drop_head(r);
+    r->next_offset = r->pos;
+  }
+
+  while (r->count < r->depth && r->next_offset < r->size)
+    ne_range_issue(r, r->next_offset);
+}
+
+static int64_t
+ne_range_read(void * buffer, size_t length, void * userdata)
+{
+  struct ne_range * r = userdata;
+  struct ne_range_block * b;
+  int64_t available;
+
+  if (r->pos >= r->size)
+    return 0;
+
+  ne_range_locate(r);
+  ne_range_wait(r);
+  b = ne_range_head(r);
+  if (b->result < 0) {
+    /* Drop the queue so the range is fetched again on the next read. */
+    while (r->count > 0)
+      ne_range_drop_head(r);
+    return -1;
+  }
+
+  available = b->offset + b->result - r->pos;
+  if (available <= 0)
+    return 0;
+  if ((uint64_t) length > (uint64_t) available)
+    length = (size_t) available;
+  memcpy(buffer, b->data + (r->pos - b->offset), length);
+  r->pos += length;
+  return (int64_t) length;
+}
+
+static int
+ne_range_seek(int64_t offset, int whence, void * userdata)
+{
+  struct ne_range * r = userdata;
+  int64_t base = 0;
+
+  if (whence == NESTEGG_SEEK_CUR)
+    base = r->pos;
+  else if (whence == NESTEGG_SEEK_END)
+    base = r->size;
+  if (base + offset < 0)
+    return -1;
+  r->pos = base + offset;
+  return 0;
+}
+
+static int64_t
+ne_range_tell(void * userdata)
+{
+  struct ne_range * r = userdata;
+  return r->pos;
+}
+
+static void
+ne_range_close(struct ne_range * r)
+{
+  unsigned int i;
+
+#if defined(NE_HAVE_PTHREAD)
+  if (r->worker_count > 0) {
+    pthread_mutex_lock(&r->lock);
+    for (i = 0; i < r->block_count; ++i) {
+      if (r->blocks[i].state == BLOCK_QUEUED)
+        r->blocks[i].state = BLOCK_IDLE;
+    }
+    r->shutdown = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    for (i = 0; i < r->worker_count; ++i)
+      pthread_join(r->workers[i], NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+  }
+  free(r->workers);
+#endif
+  if (r->blocks) {
+    for (i = 0; i < r->block_count; ++i)
+      free(r->blocks[i].data);
+    free(r->blocks);
+  }
+  free(r->queue);
+  free(r->plan);
+  free(r);
+}
+
+int
+nestegg_io_range_open(nestegg_io * io, nestegg_range_fetch fetch, void * userdata,
+                      int64_t length, size_t block_size, unsigned int workers)
+{
+  struct ne_range * r;
+  unsigned int i;
+
+  if (!fetch || length < 0)
+    return -1;
+
+  r = calloc(1, sizeof(*r));
+  if (!r)
+    return -1;
+  r->fetch = fetch;
+  r->userdata = userdata;
+  r->size = length;
+
+  r->block_size = block_size ? block_size : RANGE_BLOCK_SIZE;
+  if (r->block_size < RANGE_BLOCK_MIN_SIZE)
+    r->block_size = RANGE_BLOCK_MIN_SIZE;
+
+  /* Fetching ahead synchronously gains nothing, so without workers a
+     single block is used.  With workers, twice as many blocks as workers
+     are kept queued so that each worker has the next fetch ready as soon
+     as it completes one. */
+#if defined(NE_HAVE_PTHREAD)
+  if (workers > RANGE_MAX_WORKERS)
+    workers = RANGE_MAX_WORKERS;
+#else
+  workers = 0;
+#endif
+  r->depth = workers > 0 ? workers * 2 : 1;
+  r->block_count = r->depth + workers;
+
+  r->queue = calloc(r->depth, sizeof(*r->queue));
+  r->blocks = calloc(r->block_count, sizeof(*r->blocks));
+  if (!r->queue || !r->blocks) {
+    ne_range_close(r);
+    return -1;
+  }
+  for (i = 0; i < r->block_count; ++i) {
+    r->blocks[i].data = malloc(r->block_size);
+    if (!r->blocks[i].data) {
+      ne_range_close(r);
+      return -1;
+    }
+  }
+
+#if defined(NE_HAVE_PTHREAD)
+  if (workers > 0) {
+    r->workers = calloc(workers, sizeof(*r->workers));
+    if (!r->workers) {
+      ne_range_close(r);
+      return -1;
+    }
+    if (pthread_mutex_init(&r->lock, NULL) != 0) {
+      ne_range_close(r);
+      return -1;
+    }
+    if (pthread_cond_init(&r->cond, NULL) != 0) {
+      pthread_mutex_destroy(&r->lock);
+      ne_range_close(r);
+      return -1;
+    }
+    for (i = 0; i < workers; ++i) {
+      if (pthread_create(&r->workers[i], NULL, ne_range_worker, r) != 0)
+        break;
+      r->worker_count += 1;
+    }
+    if (r->worker_count == 0) {
+      pthread_cond_destroy(&r->cond);
+      pthread_mutex_destroy(&r->lock);
+      ne_range_close(r);
+      return -1;
+    }
+  }
+#endif
+
+  io->read = ne_range_read;
+  io->seek = ne_range_seek;
+  io->tell = ne_range_tell;
+  io->userdata = r;
+  return 0;
+}
+
+static int
+ne_range_compare_offsets(void const * a, void const * b)
+{
+  int64_t x = *(int64_t const *) a;
+  int64_t y = *(int64_t const *) b;
+  return x < y ? -1 : x > y;
+}
+
+int
+nestegg_io_range_plan(nestegg_io * io, int64_t const * offsets, unsigned int count)
+{
+  struct ne_range * r = io->userdata;
+  int64_t * plan = NULL;
+
+  if (count > 0) {
+    plan = malloc(count * sizeof(*plan));
+    if (!plan)
+      return -1;
+    memcpy(plan, offsets, count * sizeof(*plan));
+    qsort(plan, count, sizeof(*plan), ne_range_compare_offsets);
+  }
+
+  /* Blocks already queued keep their extent. */
+  free(r->plan);
+  r->plan = plan;
+  r->plan_count = count;
+  return 0;
+}
+
+void
+nestegg_io_range_close(nestegg_io * io)
+{
+  if (io->userdata)
+    ne_range_close(io->userdata);
+  memset(io, 0, sizeof(*io));
+}
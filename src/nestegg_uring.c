@@ -0,0 +1,569 @@
+/*
+ * Copyright © 2010 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#if defined(__linux__) && defined(__GNUC__) && defined(HAVE_LINUX_IO_URING_H)
+#define NE_HAVE_IO_URING
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#endif
+
+#if defined(HAVE_PREAD) && !defined(_WIN32)
+#define NE_HAVE_PREAD
+#if !defined(_GNU_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 500
+#endif
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(NE_HAVE_PREAD)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#if defined(NE_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter)
+#undef NE_HAVE_IO_URING
+#endif
+#endif
+
+#include "nestegg/nestegg.h"
+
+#define FILE_BLOCK_SIZE     (1 << 18)
+#define FILE_BLOCK_MIN_SIZE 512
+
+/* Block States */
+#define BLOCK_IDLE      0
+#define BLOCK_INFLIGHT  1
+#define BLOCK_DONE      2
+
+#if defined(NE_HAVE_PREAD)
+
+/* A block-sized read of the file at offset. */
+struct ne_block {
+  unsigned char * data;
+  int64_t offset;
+  int64_t result; /* bytes read, or -1 on error */
+  int state;
+#if defined(NE_HAVE_IO_URING)
+  struct iovec iov;
+#endif
+};
+
+#if defined(NE_HAVE_IO_URING)
+/* Submission and completion rings shared with the kernel. */
+struct ne_uring {
+  int fd;
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe * sqes;
+  size_t sqes_size;
+  unsigned int * sq_tail;
+  unsigned int * sq_mask;
+  unsigned int * sq_array;
+  unsigned int * cq_head;
+  unsigned int * cq_tail;
+  unsigned int * cq_mask;
+  struct io_uring_cqe * cqes;
+};
+#else
+struct ne_uring;
+#endif
+
+/* A file read through a queue of blocks.  The queued blocks cover the
+   contiguous range [blocks[head].offset, next_offset) and are read ahead
+   of the position; without a ring they are read synchronously one at a
+   time.  Once waiting on the ring fails, blocks still in flight may yet
+   be written by the kernel, so they stay in flight until they are reaped
+   on close, or leaked if that fails, and the file is read synchronously
+   through the others. */
+struct ne_file {
+  int fd;
+  int64_t size;
+  int64_t pos;
+  size_t block_size;
+  unsigned int depth;
+  struct ne_block * blocks;
+  unsigned int head;
+  unsigned int count;
+  int64_t next_offset;
+  struct ne_uring * ring;
+  int ring_failed;
+};
+
+static int64_t
+ne_file_expected(struct ne_file * f, struct ne_block * b)
+{
+  int64_t left = f->size - b->offset;
+  return left < (int64_t) f->block_size ? left : (int64_t) f->block_size;
+}
+
+/* Read the rest of a block synchronously, retrying short reads. */
+static void
+ne_file_read_sync(struct ne_file * f, struct ne_block * b)
+{
+  int64_t expected = ne_file_expected(f, b);
+
+  if (b->result < 0)
+    b->result = 0;
+  while (b->result < expected) {
+    ssize_t r = pread(f->fd, b->data + b->result, (size_t) (expected - b->result),
+                      (off_t) (b->offset + b->result));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0) {
+      b->result = -1;
+      break;
+    }
+    if (r == 0)
+      break;
+    b->result += r;
+  }
+  b->state = BLOCK_DONE;
+}
+
+#if defined(NE_HAVE_IO_URING)
+/* Returns the number of entries the kernel consumed, or -1 on error. */
+static int
+ne_uring_enter(struct ne_uring * ring, unsigned int submit, unsigned int wait)
+{
+  long r;
+
+  do {
+    r = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (r < 0 && errno == EINTR);
+  return r < 0 ? -1 : (int) r;
+}
+
+static void
+ne_uring_destroy(struct ne_uring * ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+static struct ne_uring *
+ne_uring_setup(unsigned int entries)
+{
+  struct io_uring_params p;
+  struct ne_uring * ring;
+  void * m;
+  unsigned char * sq;
+  unsigned char * cq;
+
+  ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  m = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           ring->fd, IORING_OFF_SQ_RING);
+  if (m == MAP_FAILED) {
+    ne_uring_destroy(ring);
+    return NULL;
+  }
+  ring->sq_ring = m;
+
+  m = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           ring->fd, IORING_OFF_CQ_RING);
+  if (m == MAP_FAILED) {
+    ne_uring_destroy(ring);
+    return NULL;
+  }
+  ring->cq_ring = m;
+
+  m = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           ring->fd, IORING_OFF_SQES);
+  if (m == MAP_FAILED) {
+    ne_uring_destroy(ring);
+    return NULL;
+  }
+  ring->sqes = m;
+
+  sq = ring->sq_ring;
+  cq = ring->cq_ring;
+  ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  return ring;
+}
+
+static int
+ne_uring_submit(struct ne_file * f, unsigned int index)
+{
+  struct ne_uring * ring = f->ring;
+  struct ne_block * b = &f->blocks[index];
+  struct io_uring_sqe * sqe;
+  unsigned int tail, slot;
+
+  b->iov.iov_base = b->data;
+  b->iov.iov_len = (size_t) ne_file_expected(f, b);
+
+  tail = *ring->sq_tail;
+  slot = tail & *ring->sq_mask;
+  sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = f->fd;
+  sqe->addr = (unsigned long) &b->iov;
+  sqe->len = 1;
+  sqe->off = (uint64_t) b->offset;
+  sqe->user_data = index;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  /* Unless the kernel consumed the entry no completion will arrive, so
+     withdraw it and let the block be read synchronously. */
+  if (ne_uring_enter(ring, 1, 0) != 1) {
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    return -1;
+  }
+  b->state = BLOCK_INFLIGHT;
+  return 0;
+}
+
+/* Wait for and record one completion. */
+static int
+ne_uring_reap(struct ne_file * f)
+{
+  struct ne_uring * ring = f->ring;
+  struct io_uring_cqe * cqe;
+  struct ne_block * b;
+  unsigned int head;
+
+  for (;;) {
+    head = *ring->cq_head;
+    if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      break;
+    if (ne_uring_enter(ring, 0, 1) < 0)
+      return -1;
+  }
+
+  cqe = &ring->cqes[head & *ring->cq_mask];
+  assert(cqe->user_data < f->depth);
+  b = &f->blocks[cqe->user_data];
+  b->result = cqe->res < 0 ? -1 : cqe->res;
+  b->state = BLOCK_DONE;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Reap blocks until none is in flight, even after the ring has failed,
+   so their buffers can be freed.  Returns the number left in flight. */
+static unsigned int
+ne_file_reap_all(struct ne_file * f)
+{
+  unsigned int i, inflight;
+
+  for (;;) {
+    inflight = 0;
+    for (i = 0; i < f->depth; ++i)
+      inflight += f->blocks[i].state == BLOCK_INFLIGHT;
+    if (inflight == 0 || ne_uring_reap(f) != 0)
+      return inflight;
+  }
+}
+#endif
+
+/* Start reading the block at index from offset. */
+static void
+ne_file_issue(struct ne_file * f, unsigned int index, int64_t offset)
+{
+  struct ne_block * b = &f->blocks[index];
+
+  assert(b->state != BLOCK_INFLIGHT);
+  b->offset = offset;
+  b->result = 0;
+#if defined(NE_HAVE_IO_URING)
+  if (f->ring && !f->ring_failed && ne_uring_submit(f, index) == 0)
+    return;
+#endif
+  ne_file_read_sync(f, b);
+}
+
+/* Wait for the block at index to complete.  A short read before the end
+   of the file is completed synchronously. */
+static void
+ne_file_wait(struct ne_file * f, unsigned int index)
+{
+  struct ne_block * b = &f->blocks[index];
+
+#if defined(NE_HAVE_IO_URING)
+  while (b->state == BLOCK_INFLIGHT) {
+    if (f->ring_failed || ne_uring_reap(f) != 0) {
+      /* The ring is unusable and the kernel may still write to the
+         buffer, so leave the block in flight until the ring is torn
+         down. */
+      f->ring_failed = 1;
+      b->result = -1;
+      return;
+    }
+  }
+#endif
+  if (b->result >= 0 && b->result < ne_file_expected(f, b))
+    ne_file_read_sync(f, b);
+}
+
+static void
+ne_file_drop_head(struct ne_file * f)
+{
+  struct ne_block * b = &f->blocks[f->head];
+
+  assert(f->count > 0);
+  ne_file_wait(f, f->head);
+  if (b->state != BLOCK_INFLIGHT)
+    b->state = BLOCK_IDLE;
+  f->head = (f->head + 1) % f->depth;
+  f->count -= 1;
+}
+
+/* After the ring has failed, keep a single complete block containing pos
+   at the head, read synchronously into a block not left in flight.  The
+   queue is left empty if every block is in flight. */
+static void
+ne_file_locate_sync(struct ne_file * f)
+{
+  struct ne_block * b = &f->blocks[f->head];
+  unsigned int i;
+
+  if (f->count == 1 && b->state == BLOCK_DONE && f->pos >= b->offset &&
+      f->pos < b->offset + (int64_t) f->block_size)
+    return;
+
+  while (f->count > 0)
+    ne_file_drop_head(f);
+  for (i = 0; i < f->depth && f->blocks[i].state == BLOCK_INFLIGHT; ++i)
+    ;
+  if (i == f->depth)
+    return;
+
+  f->head = i;
+  ne_file_issue(f, i, f->pos);
+  f->count = 1;
+  f->next_offset = f->pos + (int64_t) f->block_size;
+}
+
+/* Arrange for the head block to contain pos and queue the blocks that
+   follow it. */
+static void
+ne_file_locate(struct ne_file * f)
+{
+  if (f->count > 0 && f->pos >= f->blocks[f->head].offset && f->pos < f->next_offset) {
+    while (f->pos >= f->blocks[f->head].offset + (int64_t) f->block_size)
+      ne_file_drop_head(f);
+  } else {
+    while (f->count > 0)
+      ne_file_drop_head(f);
+    f->next_offset = f->pos;
+  }
+
+  if (f->ring_failed) {
+    ne_file_locate_sync(f);
+    return;
+  }
+
+  while (f->count < f->depth && f->next_offset < f->size) {
+    ne_file_issue(f, (f->head + f->count) % f->depth, f->next_offset);
+    f->count += 1;
+    f->next_offset += f->block_size;
+  }
+}
+
+static int64_t
+ne_file_read(void * buffer, size_t length, void * userdata)
+{
+  struct ne_file * f = userdata;
+  struct ne_block * b;
+  int64_t available;
+
+  if (f->pos >= f->size)
+    return 0;
+
+  ne_file_locate(f);
+  if (f->count == 0)
+    return -1;
+  b = &f->blocks[f->head];
+  ne_file_wait(f, f->head);
+  if (b->result < 0)
+    return -1;
+
+  available = b->offset + b->result - f->pos;
+  if (available <= 0)
+    return 0;
+  if ((uint64_t) length > (uint64_t) available)
+    length = (size_t) available;
+  memcpy(buffer, b->data + (f->pos - b->offset), length);
+  f->pos += length;
+  return (int64_t) length;
+}
+
+static int
+ne_file_seek(int64_t offset, int whence, void * userdata)
+{
+  struct ne_file * f = userdata;
+  int64_t base = 0;
+
+  if (whence == NESTEGG_SEEK_CUR)
+    base = f->pos;
+  else if (whence == NESTEGG_SEEK_END)
+    base = f->size;
+  if (base + offset < 0)
+    return -1;
+  f->pos = base + offset;
+  return 0;
+}
+
+static int64_t
+ne_file_tell(void * userdata)
+{
+  struct ne_file * f = userdata;
+  return f->pos;
+}
+
+static void
+ne_file_close(struct ne_file * f)
+{
+  unsigned int i, inflight = 0;
+
+#if defined(NE_HAVE_IO_URING)
+  if (f->ring) {
+    if (f->blocks)
+      inflight = ne_file_reap_all(f);
+    ne_uring_destroy(f->ring);
+  }
+#endif
+  /* Tearing down the ring does not cancel queued reads, so the kernel may
+     still write to blocks left in flight and they are leaked instead. */
+  if (f->blocks) {
+    for (i = 0; i < f->depth; ++i)
+      if (f->blocks[i].state != BLOCK_INFLIGHT)
+        free(f->blocks[i].data);
+    if (inflight == 0)
+      free(f->blocks);
+  }
+  if (f->fd >= 0)
+    close(f->fd);
+  free(f);
+}
+
+#endif
+
+int
+nestegg_io_uring_open(nestegg_io * io, char const * path, size_t block_size,
+                      unsigned int queue_depth)
+{
+#if defined(NE_HAVE_PREAD)
+  struct ne_file * f;
+  struct stat st;
+  unsigned int i;
+
+  f = calloc(1, sizeof(*f));
+  if (!f)
+    return -1;
+
+  f->fd = open(path, O_RDONLY);
+  if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+    ne_file_close(f);
+    return -1;
+  }
+  f->size = st.st_size;
+
+  f->block_size = block_size ? block_size : FILE_BLOCK_SIZE;
+  if (f->block_size < FILE_BLOCK_MIN_SIZE)
+    f->block_size = FILE_BLOCK_MIN_SIZE;
+
+  /* Reading ahead synchronously gains nothing, so without a ring a
+     single block is used. */
+  f->depth = 1;
+#if defined(NE_HAVE_IO_URING)
+  if (queue_depth > 0) {
+    f->ring = ne_uring_setup(queue_depth);
+    if (f->ring)
+      f->depth = queue_depth;
+  }
+#endif
+
+  f->blocks = calloc(f->depth, sizeof(*f->blocks));
+  if (!f->blocks) {
+    ne_file_close(f);
+    return -1;
+  }
+  for (i = 0; i < f->depth; ++i) {
+    f->blocks[i].data = malloc(f->block_size);
+    if (!f->blocks[i].data) {
+      ne_file_close(f);
+      return -1;
+    }
+  }
+
+  io->read = ne_file_read;
+  io->seek = ne_file_seek;
+  io->tell = ne_file_tell;
+  io->userdata = f;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int
+nestegg_io_uring_is_async(nestegg_io const * io)
+{
+#if defined(NE_HAVE_PREAD)
+  struct ne_file const * f = io->userdata;
+  return f->ring != NULL && !f->ring_failed;
+#else
+  return 0;
+#endif
+}
+
+void
+nestegg_io_uring_close(nestegg_io * io)
+{
+#if defined(NE_HAVE_PREAD)
+  if (io->userdata)
+    ne_file_close(io->userdata);
+#endif
+  memset(io, 0, sizeof(*io));
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright © 2010 Mozilla Foundation
+ *
+ * This program is made available under an ISC-style license.  See the
+ * accompanying file LICENSE for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The library is built into the benchmark so its internal decoders can
+   be timed directly. */
+#include "../src/nestegg.c"
+
+/* Parser microbenchmark.  The file is read into memory once and parsed
+   repeatedly through the IO callbacks, so the timings cover the parser
+   and its buffering rather than the file system.  The cost of decoding a
+   single element header and value is timed separately on a synthetic
+   stream of small elements.
+
+   Usage: bench <file> [iterations] */
+
+#define BENCH_ELEMENTS 1000000
+#define BENCH_ELEMENT_SIZE 6
+#define BENCH_RUNS 5
+
+struct source {
+  unsigned char const * data;
+  int64_t length;
+  int64_t offset;
+};
+
+static int64_t
+source_read(void * buffer, size_t length, void * userdata)
+{
+  struct source * s = userdata;
+
+  if (s->offset >= s->length)
+    return 0;
+  if ((int64_t) length > s->length - s->offset)
+    length = (size_t) (s->length - s->offset);
+  memcpy(buffer, s->data + s->offset, length);
+  s->offset += length;
+  return length;
+}
+
+static int
+source_seek(int64_t offset, int whence, void * userdata)
+{
+  struct source * s = userdata;
+
+  if (whence == NESTEGG_SEEK_CUR)
+    offset += s->offset;
+  else if (whence == NESTEGG_SEEK_END)
+    offset += s->length;
+  if (offset < 0 || offset > s->length)
+    return -1;
+  s->offset = offset;
+  return 0;
+}
+
+static int64_t
+source_tell(void * userdata)
+{
+  struct source * s = userdata;
+  return s->offset;
+}
+
+static double
+elapsed(clock_t start)
+{
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* Time reading the ID, size and value of CueTime elements holding a
+   4 byte uint, as the parser does for each simple element.  Returns the
+   best of BENCH_RUNS passes. */
+static double
+bench_elements(nestegg_io io, struct source * source)
+{
+  unsigned char * data;
+  nestegg * ctx;
+  uint64_t id, size, value, sum = 0;
+  clock_t start;
+  double t, best = -1;
+  int i, run;
+
+  data = malloc(BENCH_ELEMENTS * BENCH_ELEMENT_SIZE);
+  if (!data)
+    return -1;
+  for (i = 0; i < BENCH_ELEMENTS; ++i) {
+    unsigned char * p = data + i * BENCH_ELEMENT_SIZE;
+    p[0] = 0xb3;
+    p[1] = 0x84;
+    p[2] = i >> 24;
+    p[3] = i >> 16;
+    p[4] = i >> 8;
+    p[5] = i;
+  }
+  source->data = data;
+  source->length = BENCH_ELEMENTS * BENCH_ELEMENT_SIZE;
+
+  for (run = 0; run < BENCH_RUNS; ++run) {
+    source->offset = 0;
+    if (ne_context_new(&ctx, io, NULL, NULL) != 0)
+      return -1;
+    start = clock();
+    for (i = 0; i < BENCH_ELEMENTS; ++i) {
+      if (ne_read_id(&ctx->io, &id, NULL) != 1 ||
+          ne_read_vint(&ctx->io, &size, NULL) != 1 ||
+          ne_read_uint(&ctx->io, &value, size) != 1)
+        return -1;
+      sum += id + value;
+    }
+    t = elapsed(start);
+    if (best < 0 || t < best)
+      best = t;
+    nestegg_destroy(ctx);
+  }
+  free(data);
+  return sum ? best : -1;
+}
+
+int
+main(int argc, char * argv[])
+{
+  FILE * fp;
+  unsigned char * data;
+  long length;
+  struct source source;
+  nestegg_io io;
+  nestegg_init_options options;
+  nestegg * ctx;
+  nestegg_packet * pkt;
+  int64_t start_pos, end_pos;
+  uint64_t tstamp;
+  unsigned long packets = 0;
+  double init_time = 0, cues_time = 0, packets_time = 0, destroy_time = 0;
+  double pooled_time = 0;
+  clock_t start;
+  int i, iterations = 100;
+
+  if (argc < 2)
+    return EXIT_FAILURE;
+  if (argc > 2)
+    iterations = atoi(argv[2]);
+  if (iterations < 1)
+    return EXIT_FAILURE;
+
+  fp = fopen(argv[1], "rb");
+  if (!fp)
+    return EXIT_FAILURE;
+  fseek(fp, 0, SEEK_END);
+  length = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  data = malloc(length);
+  if (!data || fread(data, 1, length, fp) != (size_t) length)
+    return EXIT_FAILURE;
+  fclose(fp);
+
+  io.read = source_read;
+  io.seek = source_seek;
+  io.tell = source_tell;
+  io.userdata = &source;
+
+  printf("elements   %10.1f ns per element\n",
+         bench_elements(io, &source) / BENCH_ELEMENTS * 1e9);
+
+  source.data = data;
+  source.length = length;
+
+  for (i = 0; i < iterations; ++i) {
+    source.offset = 0;
+
+    start = clock();
+    if (nestegg_init(&ctx, io, NULL, -1) != 0)
+      return EXIT_FAILURE;
+    init_time += elapsed(start);
+
+    start = clock();
+    nestegg_get_cue_point(ctx, 0, -1, &start_pos, &end_pos, &tstamp);
+    cues_time += elapsed(start);
+
+    start = clock();
+    while (nestegg_read_packet(ctx, &pkt) > 0) {
+      nestegg_free_packet(pkt);
+      if (i == 0)
+        packets += 1;
+    }
+    packets_time += elapsed(start);
+
+    start = clock();
+    nestegg_destroy(ctx);
+    destroy_time += elapsed(start);
+  }
+
+  /* Read the packets again, recycling them through a packet pool. */
+  nestegg_init_options_default(&options);
+  options.packet_pool_size = 1 << 26;
+  for (i = 0; i < iterations; ++i) {
+    source.offset = 0;
+    if (nestegg_init_with_options(&ctx, io, NULL, -1, &options) != 0)
+      return EXIT_FAILURE;
+
+    start = clock();
+    while (nestegg_read_packet(ctx, &pkt) > 0)
+      nestegg_free_packet(pkt);
+    pooled_time += elapsed(start);
+
+    nestegg_destroy(ctx);
+  }
+
+  printf("%s: %ld bytes, %lu packets, %d iterations\n", argv[1], length, packets, iterations);
+  printf("  headers  %10.1f us\n", init_time / iterations * 1e6);
+  printf("  cues     %10.1f us\n", cues_time / iterations * 1e6);
+  printf("  packets  %10.1f us, %.1f ns per packet, %.2f ns per byte\n",
+         packets_time / iterations * 1e6,
+         packets ? packets_time / iterations / packets * 1e9 : 0.0,
+         packets_time / iterations / length * 1e9);
+  printf("  pooled   %10.1f us, %.1f ns per packet\n",
+         pooled_time / iterations * 1e6,
+         packets ? pooled_time / iterations / packets * 1e9 : 0.0);
+  printf("  destroy  %10.1f us\n", destroy_time / iterations * 1e6);
+
+  free(data);
+  return EXIT_SUCCESS;
+}
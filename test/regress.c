@@ -4,6 +4,17 @@
  * This program is made available under an ISC-style license.  See the
  * accompanying file LICENSE for details.
  */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#if defined(__linux__) && defined(__GNUC__) && defined(HAVE_LINUX_IO_URING_H)
+#define HAVE_IO_URING_PROBE
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#endif
+
 #include <assert.h>
 #include <math.h>
 #include <stdarg.h>
@@ -12,8 +23,37 @@
 #include <stdint.h>
 #include "nestegg/nestegg.h"
 
+#if defined(HAVE_IO_URING_PROBE)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if !defined(__NR_io_uring_setup)
+#undef HAVE_IO_URING_PROBE
+#endif
+#endif
+
 #include "sha1.c"
 
+/* Whether the kernel lets an io_uring of entries be created, in which
+   case nestegg_io_uring_open must read asynchronously. */
+static int
+io_uring_available(unsigned int entries)
+{
+#if defined(HAVE_IO_URING_PROBE)
+  struct io_uring_params p;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return 0;
+  close(fd);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 static void
 print_hash(uint8_t const * data, size_t len)
 {
@@ -37,6 +77,52 @@ static int seek_fail_count = 0;
 static size_t read_max = 0; /* 0 = unlimited */
 static int64_t read_max_offset_seen = 0;
 
+static int memory = 0; /* parse via nestegg_init_memory and packet views */
+static int mapped = 0; /* parse via nestegg_init_mmap and packet views */
+
+static int uring_depth = -1; /* read via nestegg_io_uring_open if >= 0 */
+static int range_workers = -1; /* read via nestegg_io_range_open if >= 0 */
+
+static int use_options = 0;
+static nestegg_init_options options;
+
+static int into = 0; /* read via nestegg_read_packet_into */
+static unsigned char * into_buffer = NULL;
+static size_t into_capacity = 0;
+
+/* Allocations made through the counting allocator and not yet freed. */
+static long live_allocations = 0;
+
+static void *
+counting_alloc(size_t size, void * userdata)
+{
+  long * live = userdata;
+  void * p;
+
+  assert(size > 0);
+  p = malloc(size);
+  if (p)
+    *live += 1;
+  return p;
+}
+
+static void *
+counting_realloc(void * ptr, size_t size, void * userdata)
+{
+  assert(ptr && size > 0);
+  return realloc(ptr, size);
+}
+
+static void
+counting_free(void * ptr, void * userdata)
+{
+  long * live = userdata;
+
+  assert(ptr && *live > 0);
+  *live -= 1;
+  free(ptr);
+}
+
 static int64_t
 stdio_read(void * p, size_t length, void * file)
 {
@@ -70,6 +156,42 @@ stdio_read(void * p, size_t length, void * file)
   return r;
 }
 
+static int64_t
+stdio_readv(nestegg_iovec const * iov, unsigned int count, void * file)
+{
+  int64_t total = 0;
+  unsigned int i;
+
+  for (i = 0; i < count; ++i) {
+    int64_t r = stdio_read(iov[i].base, iov[i].length, file);
+    if (r <= 0)
+      return total > 0 ? total : r;
+    total += r;
+    if ((size_t) r < iov[i].length)
+      break;
+  }
+  return total;
+}
+
+/* Range fetches served from a copy of the file, standing in for an
+   object store. */
+struct range_source {
+  unsigned char const * data;
+  int64_t length;
+};
+
+static int64_t
+range_fetch(void * buffer, int64_t offset, size_t length, void * userdata)
+{
+  struct range_source const * source = userdata;
+
+  assert(offset >= 0 && offset < source->length);
+  if ((int64_t) length > source->length - offset)
+    length = source->length - offset;
+  memcpy(buffer, source->data + offset, length);
+  return length;
+}
+
 static int
 stdio_seek(int64_t offset, int whence, void * file)
 {
@@ -96,12 +218,182 @@ stdio_tell(void * fp)
   return offset;
 }
 
+/* Read a packet into into_buffer, sized by nestegg_peek_packet_size,
+   after checking that an empty buffer is refused without losing the
+   packet. */
+static int
+read_packet_into(nestegg * ctx, nestegg_packet ** pkt)
+{
+  size_t size;
+  int r;
+
+  r = nestegg_peek_packet_size(ctx, &size);
+  if (r <= 0)
+    return nestegg_read_packet(ctx, pkt);
+
+  if (size > into_capacity) {
+    free(into_buffer);
+    into_buffer = malloc(size);
+    assert(into_buffer);
+    into_capacity = size;
+  }
+
+  r = nestegg_read_packet_into(ctx, into_buffer, 0, pkt);
+  if (r == 1)
+    return r;
+  assert(*pkt == NULL);
+  if (nestegg_read_reset(ctx) != 0)
+    return -1;
+
+  return nestegg_read_packet_into(ctx, into_buffer, into_capacity, pkt);
+}
+
+/* Open the file at path for reading through the stdio callbacks. */
+static FILE *
+open_stdio_io(char const * path, nestegg_io * io)
+{
+  FILE * fp;
+
+  memset(io, 0, sizeof(*io));
+  io->read = stdio_read;
+  io->seek = stdio_seek;
+  io->tell = stdio_tell;
+
+  fp = fopen(path, "rb");
+  assert(fp);
+  io->userdata = fp;
+  return fp;
+}
+
+/* Read the whole file at path into a buffer to be freed by the caller. */
+static unsigned char *
+read_file(char const * path, long * length)
+{
+  FILE * fp;
+  unsigned char * buffer;
+  int r;
+
+  fp = fopen(path, "rb");
+  assert(fp);
+  fseek(fp, 0, SEEK_END);
+  *length = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  buffer = malloc(*length);
+  assert(buffer);
+  r = fread(buffer, 1, *length, fp) == (size_t) *length;
+  assert(r);
+  fclose(fp);
+  return buffer;
+}
+
+/* The packets of a stream, in the order they were read. */
+struct packet_record {
+  unsigned int count;
+  unsigned int capacity;
+  unsigned int * tracks;
+  uint64_t * tstamps;
+  int64_t * offsets; /* as nestegg_packet_end_offset */
+  int * keyframes;
+};
+
+/* Read every remaining packet of ctx into packets. */
+static void
+record_packets(nestegg * ctx, struct packet_record * packets)
+{
+  nestegg_packet * pkt;
+  unsigned int n;
+
+  memset(packets, 0, sizeof(*packets));
+  while (nestegg_read_packet(ctx, &pkt) == 1) {
+    if (packets->count == packets->capacity) {
+      packets->capacity = packets->capacity ? packets->capacity * 2 : 256;
+      packets->tracks = realloc(packets->tracks,
+                                packets->capacity * sizeof(*packets->tracks));
+      packets->tstamps = realloc(packets->tstamps,
+                                 packets->capacity * sizeof(*packets->tstamps));
+      packets->offsets = realloc(packets->offsets,
+                                 packets->capacity * sizeof(*packets->offsets));
+      packets->keyframes = realloc(packets->keyframes,
+                                   packets->capacity * sizeof(*packets->keyframes));
+      assert(packets->tracks && packets->tstamps && packets->offsets && packets->keyframes);
+    }
+    n = packets->count++;
+    nestegg_packet_track(pkt, &packets->tracks[n]);
+    nestegg_packet_tstamp(pkt, &packets->tstamps[n]);
+    nestegg_packet_end_offset(pkt, &packets->offsets[n]);
+    packets->keyframes[n] =
+      nestegg_packet_has_keyframe(pkt) != NESTEGG_PACKET_HAS_KEYFRAME_FALSE;
+    nestegg_free_packet(pkt);
+  }
+}
+
+static void
+free_packets(struct packet_record * packets)
+{
+  free(packets->tracks);
+  free(packets->tstamps);
+  free(packets->offsets);
+  free(packets->keyframes);
+}
+
+/* The last keyframe of track before its first packet later than target,
+   or packets->count if there is none. */
+static unsigned int
+find_keyframe(struct packet_record const * packets, unsigned int track, uint64_t target)
+{
+  unsigned int i, found = packets->count;
+
+  for (i = 0; i < packets->count; ++i) {
+    if (packets->tracks[i] != track)
+      continue;
+    if (packets->tstamps[i] > target)
+      break;
+    if (packets->keyframes[i])
+      found = i;
+  }
+  return found;
+}
+
+/* Read a packet from ctx and return the recorded packet it matches. */
+static unsigned int
+read_recorded_packet(nestegg * ctx, struct packet_record const * packets)
+{
+  nestegg_packet * pkt;
+  int64_t offset;
+  unsigned int i;
+  int r;
+
+  r = nestegg_read_packet(ctx, &pkt);
+  assert(r == 1);
+  nestegg_packet_end_offset(pkt, &offset);
+  nestegg_free_packet(pkt);
+  for (i = 0; i < packets->count && packets->offsets[i] != offset; ++i)
+    ;
+  assert(i < packets->count);
+  return i;
+}
+
+/* Check that up to count packets read from ctx follow packet first in
+   order, stopping before any ending after limit unless it is negative. */
+static void
+check_recorded_packets(nestegg * ctx, struct packet_record const * packets,
+                       unsigned int first, unsigned int count, int64_t limit)
+{
+  unsigned int n;
+
+  for (n = 0; n < count && first + n < packets->count; ++n) {
+    if (limit >= 0 && packets->offsets[first + n] > limit)
+      break;
+    assert(read_recorded_packet(ctx, packets) == first + n);
+  }
+}
+
 int
 test(char const * path, int64_t read_limit, int resume, int fuzz)
 {
   FILE * fp;
   int64_t true_eos = -1;
-  int r, type, id, track_encoding, pkt_keyframe, pkt_encryption, cues;
+  int r, type, id, track_encoding, pkt_keyframe, pkt_encryption, cues, uring_async = 0;
   nestegg * ctx;
   nestegg_audio_params aparams;
   nestegg_packet * pkt;
@@ -115,6 +407,9 @@ test(char const * path, int64_t read_limit, int resume, int fuzz)
   unsigned int data_items = 0;
   uint8_t pkt_num_offsets;
   uint32_t const * pkt_partition_offsets;
+  unsigned char * buffer = NULL;
+  long buffer_length;
+  struct range_source source;
 
   nestegg_io io;
   memset(&io, 0, sizeof(io));
@@ -140,12 +435,68 @@ test(char const * path, int64_t read_limit, int resume, int fuzz)
 
   io.userdata = fp;
 
+  if (uring_depth >= 0) {
+    r = nestegg_io_uring_open(&io, path, 4096, uring_depth);
+    if (r != 0)
+      return EXIT_FAILURE;
+    /* Catch a silent fallback to synchronous reads. */
+    uring_async = uring_depth > 0 && io_uring_available(uring_depth);
+    fprintf(stderr, "io_uring: %s\n", uring_async ? "async" : "synchronous");
+    assert(nestegg_io_uring_is_async(&io) == uring_async);
+  }
+
+  if (range_workers >= 0) {
+    fseek(fp, 0, SEEK_END);
+    buffer_length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buffer = malloc(buffer_length);
+    if (!buffer || fread(buffer, 1, buffer_length, fp) != (size_t) buffer_length)
+      return EXIT_FAILURE;
+    source.data = buffer;
+    source.length = buffer_length;
+    r = nestegg_io_range_open(&io, range_fetch, &source, buffer_length, 4096, range_workers);
+    if (r != 0)
+      return EXIT_FAILURE;
+  }
+
   ctx = NULL;
   read_max_offset_seen = 0;
-  r = nestegg_init(&ctx, io, NULL, read_limit);
+  if (memory) {
+    fseek(fp, 0, SEEK_END);
+    buffer_length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buffer = malloc(buffer_length);
+    if (!buffer || fread(buffer, 1, buffer_length, fp) != (size_t) buffer_length)
+      return EXIT_FAILURE;
+    r = nestegg_init_memory(&ctx, buffer, buffer_length, NULL, read_limit);
+  } else if (mapped && use_options) {
+    r = nestegg_init_mmap_with_options(&ctx, path, NULL, read_limit, &options);
+  } else if (mapped) {
+    r = nestegg_init_mmap(&ctx, path, NULL, read_limit);
+  } else if (use_options) {
+    r = nestegg_init_with_options(&ctx, io, NULL, read_limit, &options);
+  } else {
+    r = nestegg_init(&ctx, io, NULL, read_limit);
+  }
   if (r != 0)
     return EXIT_FAILURE;
 
+  /* Plan the range fetches around the Clusters listed in the Cues. */
+  if (range_workers >= 0) {
+    int64_t offsets[64];
+    int64_t start_pos, end_pos;
+    uint64_t tstamp;
+    unsigned int count = 0;
+
+    while (count < 64 &&
+           nestegg_get_cue_point(ctx, count, -1, &start_pos, &end_pos, &tstamp) == 0 &&
+           start_pos != -1)
+      offsets[count++] = start_pos;
+    r = nestegg_io_range_plan(&io, offsets, count);
+    if (r != 0)
+      return EXIT_FAILURE;
+  }
+
   /* When max_offset is set, verify the I/O callback was never invoked
      past that offset. */
   if (read_limit > 0)
@@ -271,7 +622,12 @@ test(char const * path, int64_t read_limit, int resume, int fuzz)
 
   for (;;) {
     pkt = NULL;
-    r = nestegg_read_packet(ctx, &pkt);
+    if (into)
+      r = read_packet_into(ctx, &pkt);
+    else if (memory || mapped)
+      r = nestegg_read_packet_view(ctx, &pkt);
+    else
+      r = nestegg_read_packet(ctx, &pkt);
     if (r == 0 && resume && fake_eos < true_eos) {
       assert(pkt == NULL);
       assert(fake_eos != -1 && true_eos != -1);
@@ -337,6 +693,18 @@ test(char const * path, int64_t read_limit, int resume, int fuzz)
       }
     }
 
+    {
+      nestegg_packet_chunk const * chunks;
+      unsigned int chunk_cnt;
+
+      r = nestegg_packet_chunks(pkt, &chunks, &chunk_cnt);
+      assert(r == 0 && chunk_cnt == pkt_cnt);
+      for (i = 0; i < pkt_cnt; ++i) {
+        nestegg_packet_data(pkt, i, &ptr, &length);
+        assert(chunks[i].data == ptr && chunks[i].length == length);
+      }
+    }
+
     for (i = 0; i < pkt_cnt; ++i) {
       nestegg_packet_data(pkt, i, &ptr, &length);
       if (!fuzz) {
@@ -365,6 +733,24 @@ test(char const * path, int64_t read_limit, int resume, int fuzz)
       break;
   }
 
+  /* The batch cue table must agree with per-entry lookups. */
+  if (cues) {
+    nestegg_cue_point points[16], point;
+    unsigned int count = sizeof(points) / sizeof(points[0]), n;
+    r = nestegg_get_cue_points(ctx, 0, read_limit, points, &count);
+    if (r == 0) {
+      for (n = 0; n < count && n < sizeof(points) / sizeof(points[0]); ++n) {
+        r = nestegg_get_track_cue_point(ctx, 0, n, read_limit, &point);
+        assert(r == 0);
+        assert(point.start_pos == points[n].start_pos);
+        assert(point.end_pos == points[n].end_pos);
+        assert(point.tstamp == points[n].tstamp);
+        assert(n == 0 || points[n].tstamp >= points[n - 1].tstamp);
+      }
+      assert(nestegg_get_track_cue_point(ctx, 0, count, read_limit, &point) == -1);
+    }
+  }
+
   /* Test seek-then-read: seek to the middle of the stream using cues,
      then verify we can still read packets. */
   if (duration != (uint64_t) ~0 && cues) {
@@ -381,7 +767,24 @@ test(char const * path, int64_t read_limit, int resume, int fuzz)
     }
   }
 
+  /* The stream position is tracked across reads and seeks, so the tell
+     callback is only needed to establish it. */
+  {
+    nestegg_io_stats stats;
+    nestegg_get_io_stats(ctx, &stats);
+    assert(stats.tell_calls <= 1);
+  }
+
   nestegg_destroy(ctx);
+  assert(live_allocations == 0);
+  if (uring_depth >= 0) {
+    assert(nestegg_io_uring_is_async(&io) == uring_async);
+    nestegg_io_uring_close(&io);
+  }
+  if (range_workers >= 0)
+    nestegg_io_range_close(&io);
+  free(buffer);
+  free(into_buffer);
   fclose(fp);
   return EXIT_SUCCESS;
 }
@@ -399,6 +802,7 @@ test_read_reset_seek_failure(char const * path, int64_t read_limit)
   int cues, r;
   int64_t saved_fake_eos = fake_eos;
   int saved_seek_fail_count = seek_fail_count;
+  nestegg_init_options small;
 
   memset(&io, 0, sizeof(io));
   io.read = stdio_read;
@@ -419,8 +823,13 @@ test_read_reset_seek_failure(char const * path, int64_t read_limit)
   fake_eos = -1;
   seek_fail_count = 0;
 
+  /* Use the smallest buffer so that the reads blocked below consume more
+     than the history kept in the buffer, forcing the restores to seek. */
+  nestegg_init_options_default(&small);
+  small.io_buffer_size = 64;
+
   ctx = NULL;
-  r = nestegg_init(&ctx, io, NULL, read_limit);
+  r = nestegg_init_with_options(&ctx, io, NULL, read_limit, &small);
   assert(r == 0);
 
   nestegg_duration(ctx, &duration);
@@ -430,9 +839,9 @@ test_read_reset_seek_failure(char const * path, int64_t read_limit)
     r = nestegg_track_seek(ctx, 0, duration / 2);
     assert(r == 0);
 
-    /* Block the next packet read at the current raw stream position so the
-       subsequent read_reset must seek back to recover. */
-    fake_eos = ftell(fp);
+    /* Block the next packet read shortly after the current raw stream
+       position so the subsequent read_reset must seek back to recover. */
+    fake_eos = ftell(fp) + 16;
     pkt = NULL;
     r = nestegg_read_packet(ctx, &pkt);
     assert(r <= 0);
@@ -465,7 +874,7 @@ test_read_reset_seek_failure(char const * path, int64_t read_limit)
     r = nestegg_track_seek(ctx, 0, duration / 2);
     assert(r == 0);
 
-    fake_eos = ftell(fp);
+    fake_eos = ftell(fp) + 16;
     seek_fail_count = 1;
     last_pkt = NULL;
     r = nestegg_read_last_packet(ctx, 0, &last_pkt);
@@ -485,7 +894,7 @@ test_read_reset_seek_failure(char const * path, int64_t read_limit)
     r = nestegg_track_seek(ctx, 0, duration / 2);
     assert(r == 0);
 
-    fake_eos = ftell(fp);
+    fake_eos = ftell(fp) + 16;
     seek_fail_count = 1;
     total_frames = 0;
     r = nestegg_read_total_frames_count(ctx, &total_frames);
@@ -509,16 +918,585 @@ test_read_reset_seek_failure(char const * path, int64_t read_limit)
   seek_fail_count = saved_seek_fail_count;
 }
 
+/* Feed the file to a push context chunk bytes at a time and check that it
+   yields the same headers and packets as a context reading the file. */
+/* Seeks that look up the Cues on disk must land where seeks using the
+   loaded Cues do. */
+static void
+test_cue_window(char const * path, unsigned int window)
+{
+  FILE * fp, * window_fp;
+  nestegg * ctx, * window_ctx;
+  nestegg_packet * pkt, * window_pkt;
+  nestegg_init_options bounded;
+  nestegg_io io, window_io;
+  uint64_t duration, tstamp, pkt_tstamp, window_tstamp;
+  unsigned int track, tracks, i;
+  int r, window_r;
+
+  fp = open_stdio_io(path, &io);
+  window_fp = open_stdio_io(path, &window_io);
+
+  nestegg_init_options_default(&bounded);
+  bounded.cue_window = window;
+
+  r = nestegg_init(&ctx, io, NULL, -1);
+  assert(r == 0);
+  r = nestegg_init_with_options(&window_ctx, window_io, NULL, -1, &bounded);
+  assert(r == 0);
+
+  if (nestegg_duration(ctx, &duration) != 0)
+    duration = 0;
+  r = nestegg_track_count(ctx, &tracks);
+  assert(r == 0);
+
+  for (track = 0; track < tracks; ++track) {
+    for (i = 0; i <= 9; ++i) {
+      tstamp = i < 9 ? duration / 8 * i : ~(uint64_t) 0;
+      r = nestegg_track_seek(ctx, track, tstamp);
+      window_r = nestegg_track_seek(window_ctx, track, tstamp);
+      assert(r == window_r);
+      if (r != 0)
+        continue;
+
+      pkt = window_pkt = NULL;
+      r = nestegg_read_packet(ctx, &pkt);
+      window_r = nestegg_read_packet(window_ctx, &window_pkt);
+      assert(r == window_r);
+      if (r != 1)
+        continue;
+      nestegg_packet_tstamp(pkt, &pkt_tstamp);
+      nestegg_packet_tstamp(window_pkt, &window_tstamp);
+      assert(pkt_tstamp == window_tstamp);
+      nestegg_free_packet(pkt);
+      nestegg_free_packet(window_pkt);
+    }
+  }
+
+  nestegg_destroy(ctx);
+  nestegg_destroy(window_ctx);
+  fclose(fp);
+  fclose(window_fp);
+}
+
+/* Every entry of an index built by scanning the Clusters must lead to a
+   keyframe of its track at its timestamp, without moving the reader. */
+static void
+test_build_index(char const * path)
+{
+  FILE * fp, * fresh_fp;
+  nestegg * ctx, * fresh;
+  nestegg_packet * pkt, * fresh_pkt;
+  nestegg_cue_point * points;
+  nestegg_io io, fresh_io;
+  uint64_t tstamp, fresh_tstamp;
+  unsigned int track, tracks, count, n, pkt_track;
+  int r;
+
+  fp = open_stdio_io(path, &io);
+  fresh_fp = open_stdio_io(path, &fresh_io);
+
+  r = nestegg_init(&ctx, io, NULL, -1);
+  assert(r == 0);
+  r = nestegg_init(&fresh, fresh_io, NULL, -1);
+  assert(r == 0);
+
+  if (nestegg_build_index(ctx) != 0) {
+    nestegg_destroy(ctx);
+    nestegg_destroy(fresh);
+    fclose(fp);
+    fclose(fresh_fp);
+    return;
+  }
+  assert(nestegg_has_cues(ctx));
+
+  /* The reader still starts at the first packet. */
+  pkt = fresh_pkt = NULL;
+  r = nestegg_read_packet(ctx, &pkt);
+  assert(r == nestegg_read_packet(fresh, &fresh_pkt));
+  if (r == 1) {
+    nestegg_packet_tstamp(pkt, &tstamp);
+    nestegg_packet_tstamp(fresh_pkt, &fresh_tstamp);
+    assert(tstamp == fresh_tstamp);
+    nestegg_free_packet(pkt);
+    nestegg_free_packet(fresh_pkt);
+  }
+
+  r = nestegg_track_count(ctx, &tracks);
+  assert(r == 0);
+  for (track = 0; track < tracks; ++track) {
+    count = 0;
+    r = nestegg_get_cue_points(ctx, track, -1, NULL, &count);
+    assert(r == 0);
+    /* Tracks with no entries are found in the table of Clusters. */
+    if (count == 0) {
+      r = nestegg_track_seek(ctx, track, 0);
+      assert(r == 0);
+      r = nestegg_track_seek(ctx, track, (uint64_t) INT64_MAX);
+      assert(r == 0);
+      continue;
+    }
+    points = malloc(count * sizeof(*points));
+    assert(points);
+    r = nestegg_get_cue_points(ctx, track, -1, points, &count);
+    assert(r == 0);
+    /* The last entry ends with the last Cluster. */
+    assert(points[count - 1].end_pos >= points[count - 1].start_pos);
+
+    for (n = 0; n < count; ++n) {
+      assert(points[n].end_pos == -1 || points[n].end_pos >= points[n].start_pos);
+      r = nestegg_offset_seek(ctx, points[n].start_pos);
+      assert(r == 0);
+      /* Blocks that fail to parse are only skipped by the scan. */
+      for (;;) {
+        pkt = NULL;
+        r = nestegg_read_packet(ctx, &pkt);
+        if (r != 1)
+          break;
+        nestegg_packet_track(pkt, &pkt_track);
+        if (pkt_track == track)
+          break;
+        nestegg_free_packet(pkt);
+      }
+      if (r == 1) {
+        nestegg_packet_tstamp(pkt, &tstamp);
+        assert(tstamp == points[n].tstamp);
+        assert(nestegg_packet_has_keyframe(pkt) != NESTEGG_PACKET_HAS_KEYFRAME_FALSE);
+        nestegg_free_packet(pkt);
+      }
+
+      r = nestegg_track_seek(ctx, track, points[n].tstamp);
+      assert(r == 0);
+    }
+    free(points);
+  }
+
+  nestegg_destroy(ctx);
+  nestegg_destroy(fresh);
+  fclose(fp);
+  fclose(fresh_fp);
+}
+
+/* Check that a context reopened from a saved index seeks and reads like
+   the one the index was saved from. */
+static void
+test_index_packets(nestegg * ctx, nestegg * reopened)
+{
+  nestegg_packet * pkt, * reopened_pkt;
+  uint64_t tstamp, reopened_tstamp;
+  int r, reopened_r;
+
+  for (;;) {
+    pkt = reopened_pkt = NULL;
+    r = nestegg_read_packet(ctx, &pkt);
+    reopened_r = nestegg_read_packet(reopened, &reopened_pkt);
+    assert(r == reopened_r);
+    if (r != 1)
+      break;
+    nestegg_packet_tstamp(pkt, &tstamp);
+    nestegg_packet_tstamp(reopened_pkt, &reopened_tstamp);
+    assert(tstamp == reopened_tstamp);
+    nestegg_free_packet(pkt);
+    nestegg_free_packet(reopened_pkt);
+  }
+}
+
+static void
+test_index_reopen(nestegg * ctx, nestegg_io io)
+{
+  nestegg * reopened;
+  nestegg_cue_point point, reopened_point;
+  unsigned char * index, * unaligned;
+  size_t length = 0, saved_length;
+  unsigned int track, tracks, reopened_tracks, n;
+  uint64_t key = 0x5eed;
+  int r, reopened_r, seek_failed;
+
+  r = nestegg_save_index(ctx, key, NULL, &length);
+  assert(r == -1);
+  if (length == 0)
+    return;
+  index = malloc(length);
+  unaligned = malloc(length + 1);
+  assert(index && unaligned);
+  saved_length = length - 1;
+  r = nestegg_save_index(ctx, key, index, &saved_length);
+  assert(r == -1 && saved_length == length);
+  r = nestegg_save_index(ctx, key, index, &saved_length);
+  assert(r == 0 && saved_length == length);
+  memcpy(unaligned + 1, index, length);
+
+  /* A wrong key, a truncated or a corrupt index are refused. */
+  assert(nestegg_init_with_index(&reopened, io, NULL, NULL, index, length, key + 1) == -1);
+  assert(nestegg_init_with_index(&reopened, io, NULL, NULL, index, length - 1, key) == -1);
+  index[length - 1] ^= 1;
+  assert(nestegg_init_with_index(&reopened, io, NULL, NULL, index, length, key) == -1);
+  index[length - 1] ^= 1;
+
+  /* Check the tables used in place and copied from an unaligned index. */
+  for (n = 0; n < 2; ++n) {
+    seek_failed = 0;
+    r = nestegg_init_with_index(&reopened, io, NULL, NULL, n ? unaligned + 1 : index, length,
+                                key);
+    assert(r == 0);
+    r = nestegg_track_count(ctx, &tracks);
+    assert(r == 0);
+    r = nestegg_track_count(reopened, &reopened_tracks);
+    assert(r == 0 && tracks == reopened_tracks);
+
+    /* The first pass reads everything from the first Cluster. */
+    if (n == 0)
+      test_index_packets(ctx, reopened);
+
+    r = nestegg_read_reset(ctx);
+    assert(r == 0);
+    for (track = 0; track < tracks; ++track) {
+      assert(nestegg_track_type(ctx, track) == nestegg_track_type(reopened, track));
+      for (r = 0; nestegg_get_track_cue_point(ctx, track, r, -1, &point) == 0; ++r) {
+        reopened_r = nestegg_get_track_cue_point(reopened, track, r, -1, &reopened_point);
+        assert(reopened_r == 0);
+        assert(point.start_pos == reopened_point.start_pos);
+        assert(point.end_pos == reopened_point.end_pos);
+        assert(point.tstamp == reopened_point.tstamp);
+      }
+      assert(nestegg_get_track_cue_point(reopened, track, r, -1, &reopened_point) == -1);
+
+      r = nestegg_track_seek(ctx, track, ~(uint64_t) 0 / 2);
+      reopened_r = nestegg_track_seek(reopened, track, ~(uint64_t) 0 / 2);
+      assert(r == reopened_r);
+      seek_failed |= r != 0;
+    }
+
+    /* A failed seek leaves the readers anywhere. */
+    if (!seek_failed)
+      test_index_packets(ctx, reopened);
+    nestegg_destroy(reopened);
+  }
+
+  free(index);
+  free(unaligned);
+}
+
+/* Save and reopen an index with the Cues, and with a built index. */
+static void
+test_index(char const * path)
+{
+  FILE * fp, * reopened_fp;
+  nestegg * ctx;
+  nestegg_io io, reopened_io;
+  int r;
+
+  fp = open_stdio_io(path, &io);
+  reopened_fp = open_stdio_io(path, &reopened_io);
+
+  r = nestegg_init(&ctx, io, NULL, -1);
+  if (r == 0) {
+    test_index_reopen(ctx, reopened_io);
+    nestegg_destroy(ctx);
+
+    fseek(fp, 0, SEEK_SET);
+    r = nestegg_init(&ctx, io, NULL, -1);
+    assert(r == 0);
+    if (nestegg_build_index(ctx) == 0)
+      test_index_reopen(ctx, reopened_io);
+    nestegg_destroy(ctx);
+  }
+
+  fclose(fp);
+  fclose(reopened_fp);
+}
+
+/* A precise seek must resume reading at the last keyframe of the track at
+   or before the target, less the SeekPreRoll for audio, as found by
+   reading every packet. */
+static void
+test_precise_seek(char const * path)
+{
+  FILE * fp;
+  nestegg * ctx;
+  nestegg_audio_params params;
+  nestegg_io io;
+  struct packet_record packets;
+  uint64_t target, preroll, cluster;
+  unsigned int track, track_count, i, j, found;
+  int r;
+
+  fp = open_stdio_io(path, &io);
+  r = nestegg_init(&ctx, io, NULL, -1);
+  if (r != 0) {
+    fclose(fp);
+    return;
+  }
+  r = nestegg_track_count(ctx, &track_count);
+  assert(r == 0);
+
+  record_packets(ctx, &packets);
+
+  for (track = 0; track < track_count; ++track) {
+    preroll = 0;
+    if (nestegg_track_type(ctx, track) == NESTEGG_TRACK_AUDIO &&
+        nestegg_track_audio_params(ctx, track, &params) == 0)
+      preroll = params.seek_preroll;
+
+    for (i = 0; i < packets.count; i += packets.count / 16 + 1) {
+      if (packets.tracks[i] != track)
+        continue;
+      target = packets.tstamps[i] > preroll ? packets.tstamps[i] - preroll : 0;
+      found = find_keyframe(&packets, track, target);
+
+      r = nestegg_track_seek_precise(ctx, track, packets.tstamps[i]);
+      assert(r == 0);
+
+      /* Without a keyframe to find, reading resumes at the start of the
+         Cluster, which is where resynchronising from the end of the
+         packet before leads. */
+      if (found == packets.count) {
+        j = read_recorded_packet(ctx, &packets);
+        r = nestegg_offset_seek_resync(ctx, j > 0 ? packets.offsets[j - 1] : 0, &cluster);
+        assert(r == 0);
+        check_recorded_packets(ctx, &packets, j, 1, -1);
+        continue;
+      }
+
+      /* Reading resumes at the keyframe and carries on in order. */
+      check_recorded_packets(ctx, &packets, found, 8, -1);
+    }
+  }
+
+  free_packets(&packets);
+  nestegg_destroy(ctx);
+  fclose(fp);
+}
+
+/* Without Cues, a seek must land on a Cluster at or before the last
+   keyframe of the track at or before the target, from where reading
+   carries on in order.  The Cues are hidden by changing their ID, and
+   any bytes matching it, in a copy of the file. */
+static void
+test_bisect_seek(char const * path)
+{
+  nestegg * ctx;
+  unsigned char * buffer, * p;
+  struct packet_record packets;
+  unsigned int track, track_count, i, j, found;
+  long length;
+  int r;
+
+  buffer = read_file(path, &length);
+  for (p = buffer; p + 4 <= buffer + length; ++p)
+    if (memcmp(p, "\x1c\x53\xbb\x6b", 4) == 0)
+      p[3] ^= 1;
+
+  r = nestegg_init_memory(&ctx, buffer, length, NULL, -1);
+  if (r != 0) {
+    free(buffer);
+    return;
+  }
+  assert(!nestegg_has_cues(ctx));
+  r = nestegg_track_count(ctx, &track_count);
+  assert(r == 0);
+
+  record_packets(ctx, &packets);
+
+  for (track = 0; track < track_count; ++track) {
+    for (i = 0; i < packets.count; i += packets.count / 16 + 1) {
+      if (packets.tracks[i] != track)
+        continue;
+      found = find_keyframe(&packets, track, packets.tstamps[i]);
+
+      r = nestegg_track_seek(ctx, track, packets.tstamps[i]);
+      assert(r == 0);
+
+      /* Reading resumes at a packet no later than the keyframe. */
+      j = read_recorded_packet(ctx, &packets);
+      assert(found == packets.count || j <= found);
+      check_recorded_packets(ctx, &packets, j + 1, 7, -1);
+    }
+  }
+
+  free_packets(&packets);
+  nestegg_destroy(ctx);
+  free(buffer);
+}
+
+/* Resynchronise from offsets spread over buffer, which may be corrupt
+   from corrupt_start to corrupt_end, and check reading resumes at a
+   Cluster boundary of the packets recorded from the intact stream. */
+static void
+test_resync_offsets(unsigned char * buffer, long length,
+                    struct packet_record const * packets,
+                    long corrupt_start, long corrupt_end)
+{
+  nestegg * ctx;
+  nestegg_packet * pkt;
+  uint64_t cluster, last = 0, again;
+  int64_t offset;
+  unsigned int j;
+  long target;
+  int r, failed = 0;
+
+  r = nestegg_init_memory(&ctx, buffer, length, NULL, -1);
+  assert(r == 0);
+
+  for (target = 0; target < length; target += length / 32 + 1) {
+    r = nestegg_offset_seek_resync(ctx, target, &cluster);
+    if (r != 0) {
+      /* The first Cluster is always found from the start. */
+      assert(target > 0 || packets->count == 0);
+      failed = 1;
+      continue;
+    }
+
+    /* Clusters are found in order, and none follows a failure. */
+    assert(!failed && cluster >= (uint64_t) target && cluster >= last);
+    assert(cluster >= (uint64_t) corrupt_end || cluster < (uint64_t) corrupt_start);
+    last = cluster;
+
+    /* A Cluster resynchronises to itself. */
+    r = nestegg_offset_seek_resync(ctx, cluster, &again);
+    assert(r == 0 && again == cluster);
+
+    /* Packets are compared up to the corrupt stretch. */
+    r = nestegg_read_packet(ctx, &pkt);
+    if (r != 1)
+      continue;
+    nestegg_packet_end_offset(pkt, &offset);
+    nestegg_free_packet(pkt);
+    if (offset > corrupt_start && (int64_t) cluster < corrupt_end)
+      continue;
+    for (j = 0; j < packets->count && packets->offsets[j] != offset; ++j)
+      ;
+    assert(j < packets->count && packets->offsets[j] > (int64_t) cluster);
+    assert(j == 0 || packets->offsets[j - 1] <= (int64_t) cluster);
+
+    check_recorded_packets(ctx, packets, j + 1, 7,
+                           (int64_t) cluster < corrupt_end ? corrupt_start : -1);
+  }
+
+  nestegg_destroy(ctx);
+}
+
+static void
+test_resync(char const * path)
+{
+  nestegg * ctx;
+  unsigned char * buffer;
+  struct packet_record packets;
+  long length, i, end;
+  int r;
+  /* An unknown-sized Cluster whose first Block is of track 31. */
+  static unsigned char const fake[] = {
+    0x1f, 0x43, 0xb6, 0x75, 0x01, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xe7, 0x81, 0x00, 0xa3, 0x85, 0x9f, 0x00, 0x00, 0x80, 0x00
+  };
+
+  buffer = read_file(path, &length);
+  r = nestegg_init_memory(&ctx, buffer, length, NULL, -1);
+  if (r != 0) {
+    free(buffer);
+    return;
+  }
+  record_packets(ctx, &packets);
+  nestegg_destroy(ctx);
+
+  test_resync_offsets(buffer, length, &packets, length, length);
+
+  /* Overwrite a stretch in the second half with fake Clusters. */
+  end = length / 2 + length / 16 / (long) sizeof(fake) * (long) sizeof(fake);
+  for (i = length / 2; i < end; ++i)
+    buffer[i] = fake[(i - length / 2) % (long) sizeof(fake)];
+  test_resync_offsets(buffer, length, &packets, length / 2, end);
+
+  free_packets(&packets);
+  free(buffer);
+}
+
+static void
+test_push(char const * path, size_t chunk)
+{
+  FILE * fp;
+  nestegg * pull, * push;
+  nestegg_packet * pkt, * pull_pkt;
+  nestegg_io io;
+  unsigned char * buffer, * data, * pull_data;
+  unsigned int i, tracks, pull_tracks, count, pull_count;
+  uint64_t tstamp, pull_tstamp;
+  size_t length, pull_length, offset, n;
+  long size;
+  int r, pull_r, headers = 0;
+
+  buffer = read_file(path, &size);
+  fp = open_stdio_io(path, &io);
+  r = nestegg_init(&pull, io, NULL, -1);
+  assert(r == 0);
+  r = nestegg_init_push(&push, NULL);
+  assert(r == 0);
+
+  for (offset = 0; offset < (size_t) size; offset += n) {
+    n = (size_t) size - offset < chunk ? (size_t) size - offset : chunk;
+    r = nestegg_feed(push, buffer + offset, n, &pkt);
+    while (r > 0) {
+      if (r == NESTEGG_FEED_HEADERS) {
+        assert(!headers);
+        headers = 1;
+        nestegg_track_count(push, &tracks);
+        nestegg_track_count(pull, &pull_tracks);
+        assert(tracks == pull_tracks);
+      } else {
+        assert(r == NESTEGG_FEED_PACKET && headers && pkt);
+        pull_r = nestegg_read_packet(pull, &pull_pkt);
+        assert(pull_r == 1);
+        nestegg_packet_track(pkt, &tracks);
+        nestegg_packet_track(pull_pkt, &pull_tracks);
+        assert(tracks == pull_tracks);
+        nestegg_packet_tstamp(pkt, &tstamp);
+        nestegg_packet_tstamp(pull_pkt, &pull_tstamp);
+        assert(tstamp == pull_tstamp);
+        nestegg_packet_count(pkt, &count);
+        nestegg_packet_count(pull_pkt, &pull_count);
+        assert(count == pull_count);
+        for (i = 0; i < count; ++i) {
+          nestegg_packet_data(pkt, i, &data, &length);
+          nestegg_packet_data(pull_pkt, i, &pull_data, &pull_length);
+          assert(length == pull_length && memcmp(data, pull_data, length) == 0);
+        }
+        nestegg_free_packet(pull_pkt);
+        nestegg_free_packet(pkt);
+      }
+      r = nestegg_feed(push, NULL, 0, &pkt);
+    }
+    assert(pkt == NULL);
+    if (r < 0)
+      break;
+  }
+
+  /* Every packet the file parser can read must have been pushed. */
+  pull_pkt = NULL;
+  pull_r = nestegg_read_packet(pull, &pull_pkt);
+  assert(pull_r <= 0 && pull_pkt == NULL);
+
+  nestegg_destroy(push);
+  nestegg_destroy(pull);
+  free(buffer);
+  fclose(fp);
+}
+
 int
 main(int argc, char * argv[])
 {
   int resume = 0, fuzz = 0, seek_fail_regress = 0;
+  size_t push_chunk = 0;
+  unsigned int cue_window = 0;
+  int build_index = 0, save_index = 0, precise_seek = 0, bisect_seek = 0;
+  int resync = 0;
   int64_t read_limit = -1;
   int i;
 
   if (argc < 2)
     return EXIT_FAILURE;
 
+  nestegg_init_options_default(&options);
+
   for (i = 2; i < argc; i++) {
     if (argv[i][0] != '-')
       return EXIT_FAILURE;
@@ -545,11 +1523,131 @@ main(int argc, char * argv[])
     case 'R':
       seek_fail_regress = 1;
       break;
+    case 'm':
+      memory = 1;
+      break;
+    case 'M':
+      mapped = 1;
+      break;
+    case 'W':
+      /* -W <N>: map the file in windows of N bytes. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      options.mmap_window_size = strtol(argv[i], NULL, 10);
+      use_options = 1;
+      break;
+    case 'b':
+      /* -b <N>: IO buffer size. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      options.io_buffer_size = strtol(argv[i], NULL, 10);
+      use_options = 1;
+      break;
+    case 'a':
+      options.io_buffer_adaptive = 1;
+      use_options = 1;
+      break;
+    case 'q':
+      /* -q <N>: read through nestegg_io_uring_open with queue depth N. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      uring_depth = strtol(argv[i], NULL, 10);
+      break;
+    case 'n':
+      /* -n <N>: read through nestegg_io_range_open with N workers. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      range_workers = strtol(argv[i], NULL, 10);
+      break;
+    case 'p':
+      /* -p <N>: also check pushing the file N bytes at a time. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      push_chunk = strtol(argv[i], NULL, 10);
+      break;
+    case 'v':
+      /* -v: read frame payloads through a vectored read callback. */
+      options.io_readv = stdio_readv;
+      use_options = 1;
+      break;
+    case 'c':
+      /* -c <N>: recycle up to N bytes of packets. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      options.packet_pool_size = strtol(argv[i], NULL, 10);
+      use_options = 1;
+      break;
+    case 'i':
+      /* -i: read packets into a caller supplied buffer. */
+      into = 1;
+      break;
+    case 'A':
+      /* -A: allocate through a counting allocator and check for leaks. */
+      options.allocator.alloc = counting_alloc;
+      options.allocator.realloc = counting_realloc;
+      options.allocator.free = counting_free;
+      options.allocator.userdata = &live_allocations;
+      use_options = 1;
+      break;
+    case 'k':
+      /* -k <N>: skip by seeking at N bytes beyond the buffer. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      options.skip_seek_threshold = strtol(argv[i], NULL, 10);
+      use_options = 1;
+      break;
+    case 'x':
+      /* -x: also check an index built by scanning the Clusters. */
+      build_index = 1;
+      break;
+    case 'I':
+      /* -I: also check reopening from a saved index. */
+      save_index = 1;
+      break;
+    case 'P':
+      /* -P: also check seeking precisely to keyframes. */
+      precise_seek = 1;
+      break;
+    case 'B':
+      /* -B: also check seeking without Cues. */
+      bisect_seek = 1;
+      break;
+    case 'C':
+      /* -C: also check resynchronising to Clusters from any offset. */
+      resync = 1;
+      break;
+    case 'w':
+      /* -w <N>: also check seeking with a bounded cue window of N. */
+      if (++i >= argc)
+        return EXIT_FAILURE;
+      cue_window = strtol(argv[i], NULL, 10);
+      break;
     default:
       return EXIT_FAILURE;
     }
   }
 
+  if (push_chunk > 0)
+    test_push(argv[1], push_chunk);
+
+  if (cue_window > 0)
+    test_cue_window(argv[1], cue_window);
+
+  if (build_index)
+    test_build_index(argv[1]);
+
+  if (save_index)
+    test_index(argv[1]);
+
+  if (precise_seek)
+    test_precise_seek(argv[1]);
+
+  if (bisect_seek)
+    test_bisect_seek(argv[1]);
+
+  if (resync)
+    test_resync(argv[1]);
+
   if (seek_fail_regress)
     test_read_reset_seek_failure(argv[1], read_limit);
 